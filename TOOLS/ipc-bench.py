@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+
+"""
+Compare the throughput of the JSON and msgpack IPC protocols. Start mpv with
+--input-ipc-server=/tmp/mpvsocket and some file or --idle, then run:
+
+    TOOLS/ipc-bench.py /tmp/mpvsocket [count] [property...]
+
+For each protocol, this sends count get_property requests for each given
+property (pipelined in batches, like a client polling many properties would)
+and prints the number of requests per second, as well as the time the client
+spent encoding and decoding messages. The msgpack test requires the Python
+msgpack module.
+"""
+
+import json
+import socket
+import struct
+import sys
+import time
+
+import msgpack
+
+BATCH = 100
+
+class JSONConn:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b""
+        self.codec_time = 0
+
+    def send(self, msgs):
+        t = time.perf_counter()
+        data = b"".join(json.dumps(m).encode() + b"\n" for m in msgs)
+        self.codec_time += time.perf_counter() - t
+        self.sock.sendall(data)
+
+    def recv(self):
+        while b"\n" not in self.buf:
+            self.buf += self.sock.recv(65536)
+        line, self.buf = self.buf.split(b"\n", 1)
+        t = time.perf_counter()
+        msg = json.loads(line)
+        self.codec_time += time.perf_counter() - t
+        return msg
+
+class MsgpackConn(JSONConn):
+    def send(self, msgs):
+        t = time.perf_counter()
+        data = b""
+        for m in msgs:
+            payload = msgpack.packb(m, use_bin_type=True)
+            data += struct.pack(">I", len(payload)) + payload
+        self.codec_time += time.perf_counter() - t
+        self.sock.sendall(data)
+
+    def recv(self):
+        while True:
+            if len(self.buf) >= 4:
+                size = struct.unpack(">I", self.buf[:4])[0]
+                if len(self.buf) >= 4 + size:
+                    break
+            self.buf += self.sock.recv(65536)
+        payload = self.buf[4:4 + size]
+        self.buf = self.buf[4 + size:]
+        t = time.perf_counter()
+        msg = msgpack.unpackb(payload, raw=False)
+        self.codec_time += time.perf_counter() - t
+        return msg
+
+def wait_reply(conn, request_id):
+    while True:
+        msg = conn.recv()
+        if msg.get("request_id") == request_id:
+            return msg
+
+def run(conn, name, props, count):
+    start = time.perf_counter()
+    conn.codec_time = 0
+    next_id = 1000
+    total = 0
+    for prop in props:
+        for n in range(0, count, BATCH):
+            ids = range(next_id, next_id + min(BATCH, count - n))
+            next_id += len(ids)
+            conn.send([{"command": ["get_property", prop], "request_id": i}
+                       for i in ids])
+            for i in ids:
+                wait_reply(conn, i)
+            total += len(ids)
+    elapsed = time.perf_counter() - start
+    print("%-8s %10.0f requests/s, client codec time %5.1f%%" %
+          (name, total / elapsed, 100 * conn.codec_time / elapsed))
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 10000
+    props = sys.argv[3:] or ["time-pos", "pause", "volume", "track-list"]
+
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(sys.argv[1])
+
+    conn = JSONConn(sock)
+    run(conn, "json", props, count)
+
+    conn.send([{"command": ["set_protocol", "msgpack"], "request_id": 1}])
+    wait_reply(conn, 1)
+    mconn = MsgpackConn(sock)
+    mconn.buf = conn.buf
+    run(mconn, "msgpack", props, count)
+
+if __name__ == "__main__":
+    main()
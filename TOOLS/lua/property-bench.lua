@@ -0,0 +1,50 @@
+-- Benchmark for property access from a client. This measures how many
+-- property reads per second a script can do, optionally while it has many
+-- property observers registered (which makes every property change more
+-- expensive for the core).
+--
+-- Usage: mpv --script=property-bench.lua --idle
+--   --script-opts=property-bench-observers=200,property-bench-count=100000
+
+local options = require("mp.options")
+
+local o = {
+    -- number of properties to observe during the benchmark
+    observers = 100,
+    -- number of reads per property in each test
+    count = 20000,
+}
+options.read_options(o, "property-bench")
+
+-- Cheap properties, so that the lookup and dispatch dominate.
+local tests = {
+    "pause",
+    "volume",
+    "options/volume",
+    "playlist/count",
+    "vo-configured",
+    "property-list/0",
+}
+
+local names = mp.get_property_native("property-list")
+for i = 1, math.min(o.observers, #names) do
+    mp.observe_property(names[i], "none", function() end)
+end
+
+for _, name in ipairs(tests) do
+    local start = mp.get_time()
+    for i = 1, o.count do
+        mp.get_property(name)
+    end
+    local elapsed = mp.get_time() - start
+    print(string.format("%-20s %10.0f reads/s", name, o.count / elapsed))
+end
+
+local start = mp.get_time()
+for i = 1, o.count do
+    mp.command_native({"expand-text", "${pause} ${volume} ${playlist/count}"})
+end
+print(string.format("%-20s %10.0f commands/s", "expand-text",
+                    o.count / (mp.get_time() - start)))
+
+mp.command("quit")
@@ -0,0 +1,245 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "osdep/io.h"
+
+#include "common/common.h"
+#include "common/msg.h"
+#include "options/path.h"
+
+#include "cache.h"
+#include "packet.h"
+
+// The file is split into blocks, and each block is reused once all packets
+// stored in it have been released. This keeps the file size bounded without
+// requiring that packets are released in the same order they were written.
+#define BLOCK_SIZE (4 * 1024 * 1024)
+
+struct demux_cache {
+    struct mp_log *log;
+    FILE *file;
+
+    int *block_refs;        // number of live packets stored in each block
+    int num_blocks;         // number of blocks allocated in the file so far
+    int max_blocks;
+
+    int *free_blocks;       // blocks with block_refs[n]==0, ready for reuse
+    int num_free_blocks;
+
+    int cur_block;          // block new packets are appended to, or -1
+    int64_t cur_pos;        // append position within cur_block
+};
+
+// On-disk packet layout: header, payload, then each side data entry prefixed
+// with a side_data_header.
+struct packet_header {
+    uint32_t len;
+    uint32_t num_side_data;
+};
+
+struct side_data_header {
+    uint32_t type;
+    uint32_t size;
+};
+
+static void cache_destroy(void *ptr)
+{
+    struct demux_cache *cache = ptr;
+    if (cache->file)
+        fclose(cache->file);
+}
+
+// Create a cache file. filename can be "TMP" for an anonymous temporary file.
+// Returns NULL on failure.
+struct demux_cache *demux_cache_create(void *ta_parent,
+                                       struct mpv_global *global,
+                                       struct mp_log *log,
+                                       const char *filename,
+                                       int64_t max_size)
+{
+    struct demux_cache *cache = talloc_ptrtype(ta_parent, cache);
+    talloc_set_destructor(cache, cache_destroy);
+    *cache = (struct demux_cache){
+        .log = log,
+        .max_blocks = MPMAX(max_size / BLOCK_SIZE, 1),
+        .cur_block = -1,
+    };
+
+    if (strcmp(filename, "TMP") == 0) {
+        cache->file = tmpfile();
+    } else {
+        char *path = mp_get_user_path(NULL, global, filename);
+        cache->file = fopen(path, "wb+");
+        talloc_free(path);
+    }
+
+    if (!cache->file) {
+        mp_err(log, "can't open demuxer cache file '%s'\n", filename);
+        talloc_free(cache);
+        return NULL;
+    }
+
+    mp_verbose(log, "using demuxer cache file '%s'\n", filename);
+    return cache;
+}
+
+static size_t packet_disk_size(struct demux_packet *dp)
+{
+    size_t size = sizeof(struct packet_header) + dp->len;
+    for (int n = 0; n < dp->avpacket->side_data_elems; n++) {
+        size += sizeof(struct side_data_header);
+        size += dp->avpacket->side_data[n].size;
+    }
+    return size;
+}
+
+static bool alloc_block(struct demux_cache *cache)
+{
+    int block = -1;
+    if (cache->num_free_blocks) {
+        block = cache->free_blocks[--cache->num_free_blocks];
+    } else if (cache->num_blocks < cache->max_blocks) {
+        block = cache->num_blocks;
+        MP_TARRAY_APPEND(cache, cache->block_refs, cache->num_blocks, 0);
+    } else {
+        return false;
+    }
+
+    // The previous block was only kept because it was being appended to.
+    if (cache->cur_block >= 0 && !cache->block_refs[cache->cur_block]) {
+        MP_TARRAY_APPEND(cache, cache->free_blocks, cache->num_free_blocks,
+                         cache->cur_block);
+    }
+
+    cache->cur_block = block;
+    cache->cur_pos = 0;
+    return true;
+}
+
+// Write the packet payload and side data to the file. Returns the file
+// position, which is needed for demux_cache_read() and demux_cache_release(),
+// or -1 if the packet could not be written (e.g. because the file is full).
+int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *dp)
+{
+    if (!dp->avpacket)
+        return -1;
+
+    size_t size = packet_disk_size(dp);
+    if (size > BLOCK_SIZE)
+        return -1;
+
+    if (cache->cur_block < 0 || cache->cur_pos + size > BLOCK_SIZE) {
+        if (!alloc_block(cache))
+            return -1;
+    }
+
+    int64_t pos = cache->cur_block * (int64_t)BLOCK_SIZE + cache->cur_pos;
+    if (fseeko(cache->file, pos, SEEK_SET))
+        goto error;
+
+    AVPacket *pkt = dp->avpacket;
+    struct packet_header hdr = {
+        .len = dp->len,
+        .num_side_data = pkt->side_data_elems,
+    };
+    if (fwrite(&hdr, sizeof(hdr), 1, cache->file) != 1)
+        goto error;
+    if (dp->len && fwrite(dp->buffer, dp->len, 1, cache->file) != 1)
+        goto error;
+    for (int n = 0; n < pkt->side_data_elems; n++) {
+        struct side_data_header sd = {
+            .type = pkt->side_data[n].type,
+            .size = pkt->side_data[n].size,
+        };
+        if (fwrite(&sd, sizeof(sd), 1, cache->file) != 1)
+            goto error;
+        if (sd.size && fwrite(pkt->side_data[n].data, sd.size, 1,
+                              cache->file) != 1)
+            goto error;
+    }
+
+    cache->cur_pos += size;
+    cache->block_refs[cache->cur_block] += 1;
+    return pos;
+
+error:
+    MP_ERR(cache, "writing to demuxer cache file failed\n");
+    return -1;
+}
+
+// Read back the payload at the given position as new packet. Only the data
+// and side data are restored; other fields must be copied by the caller.
+// Returns NULL on failure.
+struct demux_packet *demux_cache_read(struct demux_cache *cache, int64_t pos)
+{
+    struct packet_header hdr;
+    if (fseeko(cache->file, pos, SEEK_SET) ||
+        fread(&hdr, sizeof(hdr), 1, cache->file) != 1)
+        goto error;
+
+    struct demux_packet *dp = new_demux_packet(hdr.len);
+    if (!dp)
+        goto error;
+
+    if (hdr.len && fread(dp->buffer, hdr.len, 1, cache->file) != 1)
+        goto error_packet;
+
+    for (int n = 0; n < hdr.num_side_data; n++) {
+        struct side_data_header sd;
+        if (fread(&sd, sizeof(sd), 1, cache->file) != 1)
+            goto error_packet;
+        uint8_t *data = av_packet_new_side_data(dp->avpacket, sd.type, sd.size);
+        if (!data)
+            goto error_packet;
+        if (sd.size && fread(data, sd.size, 1, cache->file) != 1)
+            goto error_packet;
+    }
+
+    return dp;
+
+error_packet:
+    talloc_free(dp);
+error:
+    MP_ERR(cache, "reading from demuxer cache file failed\n");
+    return NULL;
+}
+
+// Mark the packet written at pos as unused. Its space can be reused once all
+// other packets in the same block have been released.
+void demux_cache_release(struct demux_cache *cache, int64_t pos)
+{
+    int block = pos / BLOCK_SIZE;
+    assert(block >= 0 && block < cache->num_blocks);
+    assert(cache->block_refs[block] > 0);
+
+    cache->block_refs[block] -= 1;
+    if (!cache->block_refs[block]) {
+        if (block == cache->cur_block) {
+            cache->cur_pos = 0;
+        } else {
+            MP_TARRAY_APPEND(cache, cache->free_blocks, cache->num_free_blocks,
+                             block);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_DEMUX_CACHE_H_
+#define MP_DEMUX_CACHE_H_
+
+#include <stdint.h>
+
+struct demux_packet;
+struct mp_log;
+struct mpv_global;
+
+// On-disk storage for packet payloads. Not thread-safe; demux.c accesses it
+// with its own lock held.
+struct demux_cache;
+
+struct demux_cache *demux_cache_create(void *ta_parent,
+                                       struct mpv_global *global,
+                                       struct mp_log *log,
+                                       const char *filename,
+                                       int64_t max_size);
+int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *dp);
+struct demux_packet *demux_cache_read(struct demux_cache *cache, int64_t pos);
+void demux_cache_release(struct demux_cache *cache, int64_t pos);
+
+#endif
@@ -34,14 +34,17 @@
 #include "mpv_talloc.h"
 #include "common/msg.h"
 #include "common/global.h"
+#include "misc/ring.h"
 #include "osdep/atomic.h"
 #include "osdep/threads.h"
+#include "osdep/timer.h"
 
 #include "stream/stream.h"
 #include "demux.h"
 #include "timeline.h"
 #include "stheader.h"
 #include "cue.h"
+#include "cache.h"
 
 // Demuxer list
 extern const struct demuxer_desc demuxer_desc_edl;
@@ -93,6 +96,8 @@ struct demux_opts {
     int access_references;
     int seekable_cache;
     int create_ccs;
+    char *cache_file;
+    int64_t cache_file_max;
 };
 
 #define OPT_BASE_STRUCT struct demux_opts
@@ -108,6 +113,9 @@ const struct m_sub_options demux_conf = {
         OPT_CHOICE("demuxer-seekable-cache", seekable_cache, 0,
                    ({"auto", -1}, {"no", 0}, {"yes", 1})),
         OPT_FLAG("sub-create-cc-track", create_ccs, 0),
+        OPT_STRING("demuxer-cache-file", cache_file, M_OPT_FILE),
+        OPT_BYTE_SIZE("demuxer-cache-file-size", cache_file_max, 0, 0,
+                      INT64_MAX / 2),
         {0}
     },
     .size = sizeof(struct demux_opts),
@@ -118,6 +126,7 @@ const struct m_sub_options demux_conf = {
         .min_secs_cache = 10.0 * 60 * 60,
         .seekable_cache = -1,
         .access_references = 1,
+        .cache_file_max = 1024 * 1024 * 1024LL,
     },
 };
 
@@ -164,6 +173,11 @@ struct demux_internal {
     int max_bytes_bw;
     bool seekable_cache;
 
+    // If prefetch_bytes>0, read ahead up to these limits instead of min_secs
+    // and max_bytes, even if no decoder requested data yet.
+    double prefetch_secs;
+    int64_t prefetch_bytes;
+
     // At least one decoder actually requested data since init or the last seek.
     // Do this to allow the decoder thread to select streams before starting.
     bool reading;
@@ -185,6 +199,7 @@ struct demux_internal {
     double demux_ts;            // last demuxed DTS or PTS
 
     double ts_offset;           // timestamp offset to apply to everything
+                                // (written by the user thread only)
 
     void (*run_fn)(void *);     // if non-NULL, function queued to be run on
     void *run_fn_arg;           // the thread as run_fn(run_fn_arg)
@@ -195,6 +210,33 @@ struct demux_internal {
 
     size_t total_bytes;         // total sum of packet data buffered
     size_t fw_bytes;            // sum of forward packet data in current_range
+    size_t handoff_bytes;       // sum of demux_stream.handoff_bytes
+
+    // If non-NULL, packet data is additionally written to this file, and
+    // dropped from memory once the reader has passed the packet.
+    struct demux_cache *cache;
+    bool cache_broken;          // reading it failed; not used anymore
+    int64_t cache_bytes;        // sum of packet data stored in the cache file
+    int64_t cache_max_bytes;
+
+    // Time spent in range joining and pruning, which is done with the lock
+    // held (for debugging stalls).
+    int64_t maint_lock_us;      // total
+    int64_t maint_lock_max_us;  // longest single operation
+
+    // Acquisitions of the lock on the per-packet paths (demux_add_packet() and
+    // the readers), and how many of them had to wait for another thread.
+    int64_t lock_count;
+    int64_t lock_contended;
+
+    // Statistics for tuning cache options (see demux_ctrl_cache_stats).
+    int64_t cache_seeks;
+    int64_t seek_time_us;
+    int64_t seek_time_max_us;
+    int64_t pruned_packets;
+    int64_t pruned_bytes;
+    int64_t evicted_ranges;
+    int64_t evicted_bytes;
 
     // Range from which decoder is reading, and to which demuxer is appending.
     // This is never NULL. This is always ranges[num_ranges - 1].
@@ -212,6 +254,10 @@ struct demux_internal {
     int64_t stream_size;
     // Updated during init only.
     char *stream_base_filename;
+
+    // Number of packets the reader got from a handoff queue, i.e. already
+    // copied by the demuxer thread. Written by the user thread only.
+    mp_atomic_int64 handoff_reads;
 };
 
 // A continuous range of cached packets for all enabled streams.
@@ -229,7 +275,13 @@ struct demux_cached_range {
     bool is_eof;            // set if the file ends with this range
 };
 
-#define MAX_INDEX_ENTRIES 16
+// Minimum distance between keyframes added to the seek index.
+#define INDEX_STEP_SIZE 1.0
+
+struct index_entry {
+    double pts;                 // kf_seek_pts of the packet
+    struct demux_packet *pkt;
+};
 
 // A continuous list of cached packets for a single stream/range. There is one
 // for each stream and range. Also contains some state for use during demuxing
@@ -240,6 +292,8 @@ struct demux_queue {
 
     struct demux_packet *head;
     struct demux_packet *tail;
+    size_t num_packets;     // number of packets in the list
+    size_t bytes;           // sum of demux_packet_estimate_total_size()
 
     struct demux_packet *next_prune_target; // cached value for faster pruning
 
@@ -261,10 +315,24 @@ struct demux_queue {
     bool is_eof;            // received true EOF here
 
     // incomplete index to somewhat speed up seek operations
-    // the entries in index[] must be in packet queue append/removal order
-    int num_index;          // valid index[] entries
-    double index_distance;  // minimum keyframe distance to add index element
-    struct demux_packet *index[MAX_INDEX_ENTRIES];
+    // the entries in index[] must be in packet queue append/removal order, and
+    // are sorted by pts; it's a ring buffer to make removing the first entry
+    // O(1) (use QUEUE_INDEX_ENTRY() to access it)
+    struct index_entry *index;
+    size_t index_size;      // allocated size of index[] (0 or a power of 2)
+    size_t index0;          // position of the first entry in index[]
+    size_t num_index;       // number of valid entries
+};
+
+#define QUEUE_INDEX_ENTRY(q, i) \
+    ((q)->index[((q)->index0 + (i)) & ((q)->index_size - 1)])
+
+// Reader state changes for a packet in a handoff queue.
+struct handoff_info {
+    double ts;              // PTS_OR_DEF(dts, pts)
+    int len;
+    bool keyframe;
+    size_t bytes;           // demux_packet_estimate_total_size()
 };
 
 struct demux_stream {
@@ -305,17 +373,41 @@ struct demux_stream {
     bool attached_picture_added;
     bool need_wakeup;       // call wakeup_cb on next reader_head state change
 
-    // for refresh seeks: pos/dts of last packet returned to reader
+    // Packets already taken from the reader_head, stored as pointers. The
+    // demuxer thread writes to it with the lock held, and the reader takes
+    // packets from it without locking (single producer, single consumer).
+    // Packets in it are owned by this struct until they are read. The reader
+    // applies ts_offset and metadata itself (see finish_packet()).
+    struct mp_ring *handoff;
+    // Entries for the packets written to handoff, oldest first. Once the
+    // reader took the packets, sync_handoff() updates base_ts and bitrate
+    // from them. Until then, they count as forward bytes (handoff_bytes).
+    struct handoff_info *handoff_info;  // HANDOFF_PACKETS entries
+    int handoff_first;      // index of the oldest entry
+    int handoff_num;        // number of entries not synced yet
+    size_t handoff_bytes;   // summed handoff_info.bytes of those
+
+    // for refresh seeks: pos/dts of last packet taken from reader_head
+    // (including packets in the handoff queue, which are returned anyway)
     int64_t last_ret_pos;
     double last_ret_dts;
 
+    // underrun statistics (updated by the reader)
+    bool reader_started;    // a packet was returned since the last seek
+    bool in_underrun;       // reader is waiting for a packet since...
+    int64_t underrun_start; // ...this time (mp_time_us())
+    int64_t underruns[DEMUX_UNDERRUN_BUCKETS];
+    int64_t underrun_us;
+
     // for closed captions (demuxer_feed_caption)
     struct sh_stream *cc;
     bool ignore_eof;        // ignore stream in underrun detection
 
     // timed metadata
     struct mp_packet_tags *tags_demux;  // demuxer state (last updated metadata)
-    struct mp_packet_tags *tags_reader; // reader state (last returned packet)
+    // Reader state (last returned packet). After init, this is written only
+    // by the reader, so the reader can compare it without the lock.
+    struct mp_packet_tags *tags_reader;
     struct mp_packet_tags *tags_init;   // global state at start of demuxing
 };
 
@@ -335,9 +427,18 @@ struct mp_packet_tags {
 
 #define MP_ADD_PTS(a, b) ((a) == MP_NOPTS_VALUE ? (a) : ((a) + (b)))
 
+// Maximum number of packets removed by a single prune_old_packets() call. This
+// bounds the time the lock is held; the rest is pruned on the next calls.
+#define MAX_PRUNE_PACKETS 1000
+
+// Number of packets that can be handed to the reader without locking.
+#define HANDOFF_PACKETS 16
+
 static void demuxer_sort_chapters(demuxer_t *demuxer);
 static void *demux_thread(void *pctx);
 static void update_cache(struct demux_internal *in);
+static void fill_handoff(struct demux_stream *ds);
+static void sync_all_handoffs(struct demux_internal *in);
 
 #if 0
 // very expensive check for redundant cached queue state
@@ -362,10 +463,12 @@ static void check_queue_consistency(struct demux_internal *in)
 
             size_t fw_bytes = 0;
             size_t fw_packs = 0;
+            size_t queue_bytes = 0;
+            size_t queue_packs = 0;
             bool is_forward = false;
             bool kf_found = false;
             bool npt_found = false;
-            int next_index = 0;
+            size_t next_index = 0;
             for (struct demux_packet *dp = queue->head; dp; dp = dp->next) {
                 is_forward |= dp == queue->ds->reader_head;
                 kf_found |= dp == queue->keyframe_latest;
@@ -373,6 +476,8 @@ static void check_queue_consistency(struct demux_internal *in)
 
                 size_t bytes = demux_packet_estimate_total_size(dp);
                 total_bytes += bytes;
+                queue_bytes += bytes;
+                queue_packs += 1;
                 if (is_forward) {
                     fw_bytes += bytes;
                     fw_packs += 1;
@@ -384,12 +489,15 @@ static void check_queue_consistency(struct demux_internal *in)
                 if (!dp->next)
                     assert(queue->tail == dp);
 
-                if (next_index < queue->num_index && queue->index[next_index] == dp)
+                if (next_index < queue->num_index &&
+                    QUEUE_INDEX_ENTRY(queue, next_index).pkt == dp)
                     next_index += 1;
             }
             if (!queue->head)
                 assert(!queue->tail);
             assert(next_index == queue->num_index);
+            assert(queue->bytes == queue_bytes);
+            assert(queue->num_packets == queue_packs);
 
             // If the queue is currently used...
             if (queue->ds->queue == queue) {
@@ -555,6 +663,19 @@ static void update_seek_ranges(struct demux_cached_range *range)
         range->seek_start = range->seek_end = MP_NOPTS_VALUE;
 }
 
+// Free a packet that was part of a queue, and update the global accounting.
+static void free_queue_packet(struct demux_internal *in, struct demux_packet *dp)
+{
+    in->total_bytes -= demux_packet_estimate_total_size(dp);
+
+    if (dp->cached_pos >= 0) {
+        demux_cache_release(in->cache, dp->cached_pos);
+        in->cache_bytes -= dp->len;
+    }
+
+    talloc_free(dp);
+}
+
 // Remove queue->head from the queue. Does not update in->fw_bytes/in->fw_packs.
 static void remove_head_packet(struct demux_queue *queue)
 {
@@ -567,16 +688,18 @@ static void remove_head_packet(struct demux_queue *queue)
         queue->keyframe_latest = NULL;
     queue->is_bof = false;
 
-    queue->ds->in->total_bytes -= demux_packet_estimate_total_size(dp);
-
-    if (queue->num_index && queue->index[0] == dp)
-        MP_TARRAY_REMOVE_AT(queue->index, queue->num_index, 0);
+    if (queue->num_index && QUEUE_INDEX_ENTRY(queue, 0).pkt == dp) {
+        queue->index0 = (queue->index0 + 1) & (queue->index_size - 1);
+        queue->num_index -= 1;
+    }
 
     queue->head = dp->next;
     if (!queue->head)
         queue->tail = NULL;
+    queue->num_packets -= 1;
+    queue->bytes -= demux_packet_estimate_total_size(dp);
 
-    talloc_free(dp);
+    free_queue_packet(queue->ds->in, dp);
 }
 
 static void clear_queue(struct demux_queue *queue)
@@ -587,18 +710,19 @@ static void clear_queue(struct demux_queue *queue)
     struct demux_packet *dp = queue->head;
     while (dp) {
         struct demux_packet *dn = dp->next;
-        in->total_bytes -= demux_packet_estimate_total_size(dp);
         assert(ds->reader_head != dp);
-        talloc_free(dp);
+        free_queue_packet(in, dp);
         dp = dn;
     }
     queue->head = queue->tail = NULL;
+    queue->num_packets = queue->bytes = 0;
     queue->next_prune_target = NULL;
     queue->keyframe_latest = NULL;
     queue->seek_start = queue->seek_end = queue->last_pruned = MP_NOPTS_VALUE;
 
-    queue->num_index = 0;
-    queue->index_distance = 1.0;
+    talloc_free(queue->index);
+    queue->index = NULL;
+    queue->index_size = queue->index0 = queue->num_index = 0;
 
     queue->correct_dts = queue->correct_pos = true;
     queue->last_pos = -1;
@@ -643,10 +767,36 @@ static void free_empty_cached_ranges(struct demux_internal *in)
         if (in->num_ranges <= MAX_SEEK_RANGES)
             break;
 
+        in->evicted_ranges += 1;
+        for (int i = 0; i < worst->num_streams; i++)
+            in->evicted_bytes += worst->streams[i]->bytes;
         clear_cached_range(in, worst);
     }
 }
 
+// Return the next packet from the handoff queue, or NULL if it's empty. Must be
+// called by the reader (or with the lock held while the reader can't run). The
+// packet still needs finish_packet() before it's returned to the user.
+static struct demux_packet *read_handoff(struct demux_stream *ds)
+{
+    struct demux_packet *pkt = NULL;
+    if (mp_ring_read(ds->handoff, (unsigned char *)&pkt, sizeof(pkt)) <
+        sizeof(pkt))
+        return NULL;
+    return pkt;
+}
+
+static void clear_handoff(struct demux_stream *ds)
+{
+    struct demux_packet *pkt;
+    while ((pkt = read_handoff(ds)))
+        talloc_free(pkt);
+    ds->in->handoff_bytes -= ds->handoff_bytes;
+    ds->handoff_bytes = 0;
+    ds->handoff_first = 0;
+    ds->handoff_num = 0;
+}
+
 static void ds_clear_reader_queue_state(struct demux_stream *ds)
 {
     ds->in->fw_bytes -= ds->fw_bytes;
@@ -660,6 +810,7 @@ static void ds_clear_reader_queue_state(struct demux_stream *ds)
 static void ds_clear_reader_state(struct demux_stream *ds)
 {
     ds_clear_reader_queue_state(ds);
+    clear_handoff(ds);
 
     ds->base_ts = ds->last_br_ts = MP_NOPTS_VALUE;
     ds->last_br_bytes = 0;
@@ -668,6 +819,8 @@ static void ds_clear_reader_state(struct demux_stream *ds)
     ds->attached_picture_added = false;
     ds->last_ret_pos = -1;
     ds->last_ret_dts = MP_NOPTS_VALUE;
+    ds->reader_started = false;
+    ds->in_underrun = false;
 }
 
 // Call if the observed reader state on this stream somehow changes. The wakeup
@@ -797,6 +950,9 @@ struct sh_stream *demux_alloc_sh_stream(enum stream_type type)
 static void ds_destroy(void *ptr)
 {
     struct demux_stream *ds = ptr;
+    struct demux_packet *pkt;
+    while ((pkt = read_handoff(ds)))
+        talloc_free(pkt);
     mp_packet_tags_unref(ds->tags_init);
     mp_packet_tags_unref(ds->tags_reader);
     mp_packet_tags_unref(ds->tags_demux);
@@ -822,6 +978,10 @@ static void demux_add_sh_stream_locked(struct demux_internal *in,
         .global_correct_dts = true,
         .global_correct_pos = true,
     };
+    sh->ds->handoff = mp_ring_new(sh->ds, HANDOFF_PACKETS *
+                                          sizeof(struct demux_packet *));
+    sh->ds->handoff_info = talloc_array(sh->ds, struct handoff_info,
+                                        HANDOFF_PACKETS);
     talloc_set_destructor(sh->ds, ds_destroy);
 
     if (!sh->codec->codec)
@@ -1039,24 +1199,52 @@ void demuxer_feed_caption(struct sh_stream *stream, demux_packet_t *dp)
 }
 
 // Add the keyframe to the end of the index. Not all packets are actually added.
+// Packets going back in time are skipped, so the index stays sorted.
 static void add_index_entry(struct demux_queue *queue, struct demux_packet *dp)
 {
-    assert(dp->keyframe && dp->kf_seek_pts != MP_NOPTS_VALUE);
+    double pts = dp->kf_seek_pts;
+    assert(dp->keyframe && pts != MP_NOPTS_VALUE);
 
     if (queue->num_index) {
-        double prev = queue->index[queue->num_index - 1]->kf_seek_pts;
-        if (dp->kf_seek_pts < prev + queue->index_distance)
+        double prev = QUEUE_INDEX_ENTRY(queue, queue->num_index - 1).pts;
+        if (pts < prev + INDEX_STEP_SIZE)
             return;
     }
 
-    if (queue->num_index == MAX_INDEX_ENTRIES) {
-        for (int n = 0; n < MAX_INDEX_ENTRIES / 2; n++)
-            queue->index[n] = queue->index[n * 2];
-        queue->num_index = MAX_INDEX_ENTRIES / 2;
-        queue->index_distance *= 2;
+    if (queue->num_index == queue->index_size) {
+        // Must stay a power of 2, for the ring buffer wrapping.
+        size_t new_size = MPMAX(128, queue->index_size * 2);
+        MP_DBG(queue->ds->in, "stream %d: resize index to %zu\n",
+               queue->ds->index, new_size);
+        MP_RESIZE_ARRAY(queue, queue->index, new_size);
+        // Move the wrapped part of the ring buffer after the old end.
+        for (size_t n = queue->index_size; n < queue->index0 + queue->num_index; n++)
+            queue->index[n] = queue->index[n - queue->index_size];
+        queue->index_size = new_size;
     }
 
-    queue->index[queue->num_index++] = dp;
+    queue->num_index += 1;
+    QUEUE_INDEX_ENTRY(queue, queue->num_index - 1) = (struct index_entry){
+        .pts = pts,
+        .pkt = dp,
+    };
+}
+
+// Lock in->lock, and count whether another thread was holding it.
+static void lock_counted(struct demux_internal *in)
+{
+    bool contended = pthread_mutex_trylock(&in->lock) != 0;
+    if (contended)
+        pthread_mutex_lock(&in->lock);
+    in->lock_count += 1;
+    in->lock_contended += contended;
+}
+
+static void account_maint_time(struct demux_internal *in, int64_t start)
+{
+    int64_t t = mp_time_us() - start;
+    in->maint_lock_us += t;
+    in->maint_lock_max_us = MPMAX(in->maint_lock_max_us, t);
 }
 
 // Check whether the next range in the list is, and if it appears to overlap,
@@ -1085,6 +1273,8 @@ static void attempt_range_joining(struct demux_internal *in)
     if (!next)
         return;
 
+    int64_t start_time = mp_time_us();
+
     MP_VERBOSE(in, "going to join ranges %f-%f + %f-%f\n",
                in->current_range->seek_start, in->current_range->seek_end,
                next->seek_start, next->seek_end);
@@ -1186,6 +1376,15 @@ static void attempt_range_joining(struct demux_internal *in)
             q1->tail = q2->tail;
         }
 
+        // All of q2 is appended after the reader position (if any), so the
+        // forward buffer grows by exactly q2's contents.
+        if (ds->reader_head) {
+            ds->fw_packs += q2->num_packets;
+            ds->fw_bytes += q2->bytes;
+        }
+        q1->num_packets += q2->num_packets;
+        q1->bytes += q2->bytes;
+
         q1->seek_end = q2->seek_end;
         q1->correct_dts &= q2->correct_dts;
         q1->correct_pos &= q2->correct_pos;
@@ -1198,14 +1397,14 @@ static void attempt_range_joining(struct demux_internal *in)
         q1->is_eof = q2->is_eof;
 
         q2->head = q2->tail = NULL;
+        q2->num_packets = q2->bytes = 0;
         q2->next_prune_target = NULL;
         q2->keyframe_latest = NULL;
 
-        for (int i = 0; i < q2->num_index; i++)
-            add_index_entry(q1, q2->index[i]);
+        for (size_t i = 0; i < q2->num_index; i++)
+            add_index_entry(q1, QUEUE_INDEX_ENTRY(q2, i).pkt);
         q2->num_index = 0;
 
-        recompute_buffers(ds);
         in->fw_bytes += ds->fw_bytes;
 
         // For moving demuxer position.
@@ -1224,6 +1423,8 @@ static void attempt_range_joining(struct demux_internal *in)
 failed:
     clear_cached_range(in, next);
     free_empty_cached_ranges(in);
+
+    account_maint_time(in, start_time);
 }
 
 // Determine seekable range when a packet is added. If dp==NULL, treat it as
@@ -1281,15 +1482,15 @@ static void adjust_seek_range_on_packet(struct demux_stream *ds,
         attempt_range_joining(ds->in);
 }
 
-void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp)
+// Takes ownership of dp. Lock must be held.
+static void add_packet_locked(struct sh_stream *stream, demux_packet_t *dp)
 {
     struct demux_stream *ds = stream ? stream->ds : NULL;
-    if (!dp || !dp->len || !ds || demux_cancel_test(ds->in->d_thread)) {
+    if (!dp || !dp->len || !ds) {
         talloc_free(dp);
         return;
     }
     struct demux_internal *in = ds->in;
-    pthread_mutex_lock(&in->lock);
 
     in->initial_state = false;
 
@@ -1319,7 +1520,6 @@ void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp)
     }
 
     if (drop) {
-        pthread_mutex_unlock(&in->lock);
         talloc_free(dp);
         return;
     }
@@ -1335,6 +1535,12 @@ void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp)
     dp->next = NULL;
     mp_packet_tags_setref(&dp->metadata, ds->tags_demux);
 
+    if (in->cache && !in->cache_broken && in->seekable_cache) {
+        dp->cached_pos = demux_cache_write(in->cache, dp);
+        if (dp->cached_pos >= 0)
+            in->cache_bytes += dp->len;
+    }
+
     // (keep in mind that even if the reader went out of data, the queue is not
     // necessarily empty due to the backbuffer)
     if (!ds->reader_head && (!ds->skip_to_keyframe || dp->keyframe)) {
@@ -1358,6 +1564,8 @@ void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp)
         // first packet in stream
         queue->head = queue->tail = dp;
     }
+    queue->num_packets += 1;
+    queue->bytes += bytes;
 
     if (!ds->ignore_eof) {
         // obviously not true anymore
@@ -1397,7 +1605,38 @@ void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp)
         }
     }
 
+    fill_handoff(ds);
     wakeup_ds(ds);
+}
+
+void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp)
+{
+    struct demux_stream *ds = stream ? stream->ds : NULL;
+    if (!dp || !ds || demux_cancel_test(ds->in->d_thread)) {
+        talloc_free(dp);
+        return;
+    }
+    struct demux_internal *in = ds->in;
+    lock_counted(in);
+    add_packet_locked(stream, dp);
+    pthread_mutex_unlock(&in->lock);
+}
+
+// Same as calling demux_add_packet(streams[n], pkts[n]) for each n, but takes
+// the lock only once. All streams must belong to the given demuxer.
+void demux_add_packets(struct demuxer *demuxer, struct sh_stream **streams,
+                       struct demux_packet **pkts, int num_pkts)
+{
+    struct demux_internal *in = demuxer->in;
+    assert(demuxer == in->d_thread);
+    if (demux_cancel_test(demuxer)) {
+        for (int n = 0; n < num_pkts; n++)
+            talloc_free(pkts[n]);
+        return;
+    }
+    lock_counted(in);
+    for (int n = 0; n < num_pkts; n++)
+        add_packet_locked(streams[n], pkts[n]);
     pthread_mutex_unlock(&in->lock);
 }
 
@@ -1414,18 +1653,24 @@ static bool read_packet(struct demux_internal *in)
     // the minimum, or if a stream explicitly needs new packets. Also includes
     // safe-guards against packet queue overflow.
     bool read_more = false, prefetch_more = false, refresh_more = false;
+    double min_secs = in->prefetch_bytes ? in->prefetch_secs : in->min_secs;
+    sync_all_handoffs(in);
+    size_t fw_bytes = in->fw_bytes + in->handoff_bytes;
     for (int n = 0; n < in->num_streams; n++) {
         struct demux_stream *ds = in->streams[n]->ds;
         read_more |= ds->eager && !ds->reader_head;
         refresh_more |= ds->refreshing;
         if (ds->eager && ds->queue->last_ts != MP_NOPTS_VALUE &&
-            in->min_secs > 0 && ds->base_ts != MP_NOPTS_VALUE &&
+            min_secs > 0 && ds->base_ts != MP_NOPTS_VALUE &&
             ds->queue->last_ts >= ds->base_ts)
-            prefetch_more |= ds->queue->last_ts - ds->base_ts < in->min_secs;
+            prefetch_more |= ds->queue->last_ts - ds->base_ts < min_secs;
     }
     MP_TRACE(in, "bytes=%zd, read_more=%d prefetch_more=%d, refresh_more=%d\n",
-             in->fw_bytes, read_more, prefetch_more, refresh_more);
-    if (in->fw_bytes >= in->max_bytes) {
+             fw_bytes, read_more, prefetch_more, refresh_more);
+    // Nobody is waiting for packets yet, so simply stop at the budget.
+    if (in->prefetch_bytes && fw_bytes >= in->prefetch_bytes)
+        return false;
+    if (fw_bytes >= in->max_bytes) {
         // if we hit the limit just by prefetching, simply stop prefetching
         if (!read_more)
             return false;
@@ -1507,9 +1752,16 @@ static void prune_old_packets(struct demux_internal *in)
 
     // It's not clear what the ideal way to prune old packets is. For now, we
     // prune the oldest packet runs, as long as the total cache amount is too
-    // big.
+    // big. The disk cache has its own limit, and is pruned the same way.
     size_t max_bytes = in->seekable_cache ? in->max_bytes_bw : 0;
-    while (in->total_bytes - in->fw_bytes > max_bytes) {
+    int64_t start_time = mp_time_us();
+    int budget = MAX_PRUNE_PACKETS;
+    while (budget > 0) {
+        bool over_mem = in->total_bytes - in->fw_bytes > max_bytes;
+        bool over_disk = in->cache_bytes > in->cache_max_bytes;
+        if (!over_mem && !over_disk)
+            break;
+
         // (Start from least recently used range.)
         struct demux_cached_range *range = in->ranges[0];
         double earliest_ts = MP_NOPTS_VALUE;
@@ -1535,6 +1787,10 @@ static void prune_old_packets(struct demux_internal *in)
             }
         }
 
+        // The disk cache can contain forward packets after a cache seek.
+        if (!earliest_stream && !over_mem)
+            break;
+
         assert(earliest_stream); // incorrect accounting of buffered sizes?
         struct demux_stream *ds = earliest_stream;
         struct demux_queue *queue = range->streams[ds->index];
@@ -1569,14 +1825,22 @@ static void prune_old_packets(struct demux_internal *in)
         }
 
         bool done = false;
-        while (!done && queue->head && queue->head != ds->reader_head) {
+        while (!done && budget > 0 && queue->head &&
+               queue->head != ds->reader_head)
+        {
             done = queue->next_prune_target == queue->head;
+            in->pruned_packets += 1;
+            in->pruned_bytes += demux_packet_estimate_total_size(queue->head);
             remove_head_packet(queue);
+            budget--;
         }
 
         if (range != in->current_range && range->seek_start == MP_NOPTS_VALUE)
             free_empty_cached_ranges(in);
     }
+
+    if (budget < MAX_PRUNE_PACKETS)
+        account_maint_time(in, start_time);
 }
 
 static void execute_trackswitch(struct demux_internal *in)
@@ -1612,13 +1876,20 @@ static void execute_seek(struct demux_internal *in)
 
     MP_VERBOSE(in, "execute seek (to %f flags %d)\n", pts, flags);
 
+    int64_t start = mp_time_us();
+
     if (in->d_thread->desc->seek)
         in->d_thread->desc->seek(in->d_thread, pts, flags);
 
+    int64_t duration = mp_time_us() - start;
+
     MP_VERBOSE(in, "seek done\n");
 
     pthread_mutex_lock(&in->lock);
 
+    in->seek_time_us += duration;
+    in->seek_time_max_us = MPMAX(in->seek_time_max_us, duration);
+
     in->seeking_in_progress = MP_NOPTS_VALUE;
 }
 
@@ -1668,7 +1939,10 @@ static void *demux_thread(void *pctx)
     return NULL;
 }
 
-static struct demux_packet *dequeue_packet(struct demux_stream *ds)
+// Remove the next packet from the reader_head queue, and return a copy owned
+// by the caller. This updates only the demuxer side of the state; the caller
+// must update the reader state (update_reader_ts(), finish_packet()).
+static struct demux_packet *take_packet(struct demux_stream *ds)
 {
     if (ds->sh->attached_picture) {
         ds->eof = true;
@@ -1681,31 +1955,70 @@ static struct demux_packet *dequeue_packet(struct demux_stream *ds)
         pkt->stream = ds->sh->index;
         return pkt;
     }
-    if (!ds->reader_head || ds->in->blocked)
-        return NULL;
-    struct demux_packet *pkt = ds->reader_head;
-    ds->reader_head = pkt->next;
-
-    // Update cached packet queue state.
-    ds->fw_packs--;
-    size_t bytes = demux_packet_estimate_total_size(pkt);
-    ds->fw_bytes -= bytes;
-    ds->in->fw_bytes -= bytes;
+    struct demux_internal *in = ds->in;
+    struct demux_packet *src, *pkt = NULL;
+    size_t bytes;
+    while (!pkt) {
+        if (!ds->reader_head || in->blocked)
+            return NULL;
+        src = ds->reader_head;
+        ds->reader_head = src->next;
+
+        ds->last_ret_pos = src->pos;
+        ds->last_ret_dts = src->dts;
+
+        // Update cached packet queue state.
+        ds->fw_packs--;
+        bytes = demux_packet_estimate_total_size(src);
+        ds->fw_bytes -= bytes;
+        in->fw_bytes -= bytes;
+
+        // The returned packet is mutated etc. and will be owned by the user.
+        if (src->is_cached) {
+            if (!in->cache_broken)
+                pkt = demux_cache_read(in->cache, src->cached_pos);
+            if (!pkt) {
+                // Skip it; there's not much else we can do. Don't try the
+                // cache file again, as the following packets would most
+                // likely fail the same way.
+                if (!in->cache_broken) {
+                    MP_ERR(in, "Dropping unreadable cached packets and "
+                           "disabling the demuxer cache file.\n");
+                }
+                in->cache_broken = true;
+                continue;
+            }
+            demux_packet_copy_attribs(pkt, src);
+        } else {
+            pkt = demux_copy_packet(src);
+            if (!pkt)
+                abort();
+        }
+    }
+    pkt->next = NULL;
 
-    ds->last_ret_pos = pkt->pos;
-    ds->last_ret_dts = pkt->dts;
+    // The packet is in the back buffer now, which can be served from the disk
+    // cache if the user seeks back.
+    if (src->cached_pos >= 0 && !src->is_cached && !in->cache_broken) {
+        demux_packet_unref_contents(src);
+        src->is_cached = true;
+        size_t new_bytes = demux_packet_estimate_total_size(src);
+        in->total_bytes = in->total_bytes - bytes + new_bytes;
+        ds->queue->bytes = ds->queue->bytes - bytes + new_bytes;
+    }
 
-    // The returned packet is mutated etc. and will be owned by the user.
-    pkt = demux_copy_packet(pkt);
-    if (!pkt)
-        abort();
-    pkt->next = NULL;
+    return pkt;
+}
 
-    double ts = PTS_OR_DEF(pkt->dts, pkt->pts);
+// Update the reader's position and the bitrate for a packet returned to the
+// user.
+static void update_reader_ts(struct demux_stream *ds, double ts, int len,
+                             bool keyframe)
+{
     if (ts != MP_NOPTS_VALUE)
         ds->base_ts = ts;
 
-    if (pkt->keyframe && ts != MP_NOPTS_VALUE) {
+    if (keyframe && ts != MP_NOPTS_VALUE) {
         // Update bitrate - only at keyframe points, because we use the
         // (possibly) reordered packet timestamps instead of realtime.
         double d = ts - ds->last_br_ts;
@@ -1719,36 +2032,172 @@ static struct demux_packet *dequeue_packet(struct demux_stream *ds)
             ds->last_br_bytes = 0;
         }
     }
-    ds->last_br_bytes += pkt->len;
+    ds->last_br_bytes += len;
+}
+
+// Apply the handoff_info entries of the packets the reader has taken from the
+// handoff queue since the last call. Must be called with the lock held.
+static void sync_handoff(struct demux_stream *ds)
+{
+    // The reader can only take more packets concurrently, so this is a lower
+    // bound of the packets taken.
+    int left = mp_ring_buffered(ds->handoff) / sizeof(struct demux_packet *);
+    while (ds->handoff_num > left) {
+        struct handoff_info *info = &ds->handoff_info[ds->handoff_first];
+        update_reader_ts(ds, info->ts, info->len, info->keyframe);
+        ds->handoff_bytes -= info->bytes;
+        ds->in->handoff_bytes -= info->bytes;
+        ds->handoff_first = (ds->handoff_first + 1) % HANDOFF_PACKETS;
+        ds->handoff_num--;
+    }
+}
 
-    // This implies this function is actually called from "the" user thread.
-    if (pkt->pos >= ds->in->d_user->filepos)
-        ds->in->d_user->filepos = pkt->pos;
+static void sync_all_handoffs(struct demux_internal *in)
+{
+    for (int n = 0; n < in->num_streams; n++)
+        sync_handoff(in->streams[n]->ds);
+}
 
-    pkt->pts = MP_ADD_PTS(pkt->pts, ds->in->ts_offset);
-    pkt->dts = MP_ADD_PTS(pkt->dts, ds->in->ts_offset);
+// Finish a packet that is returned to the user: apply the timestamp offset,
+// and signal timed metadata changes. For packets from the handoff queue, this
+// is called by the reader without the lock (locked==false), and the lock is
+// taken only if the metadata changed.
+static void finish_packet(struct demux_stream *ds, struct demux_packet *pkt,
+                          bool locked)
+{
+    struct demux_internal *in = ds->in;
+
+    if (ds->sh->attached_picture)
+        return;
+
+    pkt->pts = MP_ADD_PTS(pkt->pts, in->ts_offset);
+    pkt->dts = MP_ADD_PTS(pkt->dts, in->ts_offset);
 
     if (pkt->segmented) {
-        pkt->start = MP_ADD_PTS(pkt->start, ds->in->ts_offset);
-        pkt->end = MP_ADD_PTS(pkt->end, ds->in->ts_offset);
+        pkt->start = MP_ADD_PTS(pkt->start, in->ts_offset);
+        pkt->end = MP_ADD_PTS(pkt->end, in->ts_offset);
     }
 
     // Apply timed metadata when packet is returned to user.
-    // (The tags_init thing is a microopt. to not do refcounting for sane files.)
+    // (The tags_init thing is a microopt. to not do refcounting for sane files.
+    // fill_handoff() resolves it for packets in the handoff queue.)
     struct mp_packet_tags *metadata = pkt->metadata;
-    if (!metadata)
+    if (!metadata) {
+        assert(locked);
         metadata = ds->tags_init;
+    }
     if (metadata != ds->tags_reader) {
+        if (!locked)
+            lock_counted(in);
         mp_packet_tags_setref(&ds->tags_reader, metadata);
-        ds->in->events |= DEMUX_EVENT_METADATA;
-        if (ds->in->wakeup_cb)
-            ds->in->wakeup_cb(ds->in->wakeup_cb_ctx);
+        in->events |= DEMUX_EVENT_METADATA;
+        if (in->wakeup_cb)
+            in->wakeup_cb(in->wakeup_cb_ctx);
+        if (!locked)
+            pthread_mutex_unlock(&in->lock);
     }
+}
 
+// Must be called with the lock held, and only if the handoff queue is empty.
+static struct demux_packet *dequeue_packet(struct demux_stream *ds)
+{
+    struct demux_packet *pkt = take_packet(ds);
+    if (!pkt)
+        return NULL;
+    if (!ds->sh->attached_picture) {
+        sync_handoff(ds);
+        update_reader_ts(ds, PTS_OR_DEF(pkt->dts, pkt->pts), pkt->len,
+                         pkt->keyframe);
+    }
+    finish_packet(ds, pkt, true);
     prune_old_packets(ds->in);
     return pkt;
 }
 
+// Return the next packet from the handoff queue, or NULL if it's empty. Must be
+// called by the reader with the lock held.
+static struct demux_packet *read_handoff_locked(struct demux_stream *ds)
+{
+    struct demux_packet *pkt = read_handoff(ds);
+    if (pkt)
+        finish_packet(ds, pkt, true);
+    return pkt;
+}
+
+// Copy packets from the reader_head to the handoff queue, so that this work is
+// done on the demuxer thread, and the reader only has to finish them. This is
+// done only if the reader is known to come back for more (i.e. it's an eagerly
+// read stream in threaded mode). While prefetching, the player doesn't own the
+// demuxer yet, so it's not done either.
+static void fill_handoff(struct demux_stream *ds)
+{
+    struct demux_internal *in = ds->in;
+    if (!in->threading || !in->reading || !ds->eager ||
+        ds->sh->attached_picture || in->prefetch_bytes)
+        return;
+
+    sync_handoff(ds);
+
+    bool added = false;
+    while (ds->reader_head && ds->handoff_num < HANDOFF_PACKETS &&
+           mp_ring_available(ds->handoff) >= sizeof(struct demux_packet *))
+    {
+        struct demux_packet *pkt = take_packet(ds);
+        if (!pkt)
+            break;
+        if (!pkt->metadata)
+            mp_packet_tags_setref(&pkt->metadata, ds->tags_init);
+        size_t bytes = demux_packet_estimate_total_size(pkt);
+        int index = (ds->handoff_first + ds->handoff_num) % HANDOFF_PACKETS;
+        ds->handoff_info[index] = (struct handoff_info){
+            .ts = PTS_OR_DEF(pkt->dts, pkt->pts),
+            .len = pkt->len,
+            .keyframe = pkt->keyframe,
+            .bytes = bytes,
+        };
+        ds->handoff_num++;
+        ds->handoff_bytes += bytes;
+        in->handoff_bytes += bytes;
+        mp_ring_write(ds->handoff, (unsigned char *)&pkt, sizeof(pkt));
+        added = true;
+    }
+
+    if (added)
+        prune_old_packets(in);
+}
+
+// Update reader state that is accessed by the user thread only.
+static void update_reader_pos(struct demux_internal *in,
+                              struct demux_packet *pkt)
+{
+    if (pkt && pkt->pos >= in->d_user->filepos)
+        in->d_user->filepos = pkt->pos;
+}
+
+// Track how long the reader had to wait for new packets. r is the result of
+// demux_read_packet_async(). The wait for the first packet after a seek is not
+// counted.
+static void update_underrun_stats(struct demux_stream *ds, int r)
+{
+    static const double limits[] = DEMUX_UNDERRUN_LIMITS;
+
+    if (r > 0) {
+        if (ds->in_underrun) {
+            int64_t duration = mp_time_us() - ds->underrun_start;
+            int n = 0;
+            while (n < DEMUX_UNDERRUN_BUCKETS - 1 && duration / 1e6 >= limits[n])
+                n++;
+            ds->underruns[n] += 1;
+            ds->underrun_us += duration;
+            ds->in_underrun = false;
+        }
+        ds->reader_started = true;
+    } else if (r == 0 && ds->reader_started && !ds->in_underrun) {
+        ds->in_underrun = true;
+        ds->underrun_start = mp_time_us();
+    }
+}
+
 // Read a packet from the given stream. The returned packet belongs to the
 // caller, who has to free it with talloc_free(). Might block. Returns NULL
 // on EOF.
@@ -1758,8 +2207,10 @@ struct demux_packet *demux_read_packet(struct sh_stream *sh)
     if (!ds)
         return NULL;
     struct demux_internal *in = ds->in;
-    pthread_mutex_lock(&in->lock);
-    if (ds->eager) {
+    lock_counted(in);
+    // Packets that were already handed off come first.
+    struct demux_packet *pkt = read_handoff_locked(ds);
+    if (!pkt && ds->eager) {
         const char *t = stream_type_name(ds->type);
         MP_DBG(in, "reading packet for %s\n", t);
         in->eof = false; // force retry
@@ -1777,10 +2228,14 @@ struct demux_packet *demux_read_packet(struct sh_stream *sh)
             if (ds->eof)
                 break;
         }
+        // The demux thread could have handed off packets while waiting.
+        pkt = read_handoff_locked(ds);
     }
-    struct demux_packet *pkt = dequeue_packet(ds);
+    if (!pkt)
+        pkt = dequeue_packet(ds);
     pthread_cond_signal(&in->wakeup); // possibly read more
     pthread_mutex_unlock(&in->lock);
+    update_reader_pos(in, pkt);
     return pkt;
 }
 
@@ -1803,21 +2258,38 @@ int demux_read_packet_async(struct sh_stream *sh, struct demux_packet **out_pkt)
     *out_pkt = NULL;
     if (!ds)
         return r;
-    if (ds->in->threading) {
-        pthread_mutex_lock(&ds->in->lock);
-        *out_pkt = dequeue_packet(ds);
+    struct demux_internal *in = ds->in;
+    // Common case: the demux thread has already dequeued and copied the
+    // packet for us. Reading the demuxer is needed only once the handoff queue
+    // has run empty.
+    *out_pkt = read_handoff(ds);
+    if (*out_pkt) {
+        atomic_fetch_add(&in->handoff_reads, 1);
+        finish_packet(ds, *out_pkt, false);
+        update_reader_pos(in, *out_pkt);
+        update_underrun_stats(ds, 1);
+        return 1;
+    }
+    if (in->threading) {
+        lock_counted(in);
+        // Check again; the queue could have been filled in the meantime.
+        fill_handoff(ds);
+        *out_pkt = read_handoff_locked(ds);
+        if (!*out_pkt)
+            *out_pkt = dequeue_packet(ds);
         if (ds->eager) {
             r = *out_pkt ? 1 : (ds->eof ? -1 : 0);
-            ds->in->reading = true; // enable readahead
-            ds->in->eof = false; // force retry
-            pthread_cond_signal(&ds->in->wakeup); // possibly read more
+            in->reading = true; // enable readahead
+            in->eof = false; // force retry
+            pthread_cond_signal(&in->wakeup); // possibly read more
         } else {
             r = *out_pkt ? 1 : -1;
         }
         ds->need_wakeup = r != 1;
-        pthread_mutex_unlock(&ds->in->lock);
+        update_underrun_stats(ds, r);
+        pthread_mutex_unlock(&in->lock);
     } else {
-        if (ds->in->blocked) {
+        if (in->blocked) {
             r = 0;
         } else {
             *out_pkt = demux_read_packet(sh);
@@ -1825,6 +2297,7 @@ int demux_read_packet_async(struct sh_stream *sh, struct demux_packet **out_pkt)
         }
         ds->need_wakeup = r != 1;
     }
+    update_reader_pos(in, *out_pkt);
     return r;
 }
 
@@ -1834,7 +2307,7 @@ bool demux_has_packet(struct sh_stream *sh)
     bool has_packet = false;
     if (sh) {
         pthread_mutex_lock(&sh->ds->in->lock);
-        has_packet = sh->ds->reader_head;
+        has_packet = sh->ds->reader_head || mp_ring_buffered(sh->ds->handoff);
         pthread_mutex_unlock(&sh->ds->in->lock);
     }
     return has_packet;
@@ -1849,9 +2322,14 @@ struct demux_packet *demux_read_any_packet(struct demuxer *demuxer)
     while (read_more && !in->blocked) {
         for (int n = 0; n < in->num_streams; n++) {
             in->reading = true; // force read_packet() to read
-            struct demux_packet *pkt = dequeue_packet(in->streams[n]->ds);
-            if (pkt)
+            struct demux_stream *ds = in->streams[n]->ds;
+            struct demux_packet *pkt = read_handoff_locked(ds);
+            if (!pkt)
+                pkt = dequeue_packet(ds);
+            if (pkt) {
+                update_reader_pos(in, pkt);
                 return pkt;
+            }
         }
         // retry after calling this
         pthread_mutex_lock(&in->lock); // lock only because thread_work unlocks
@@ -2187,6 +2665,7 @@ static struct demuxer *open_given_type(struct mpv_global *global,
         .access_references = opts->access_references,
         .events = DEMUX_EVENT_ALL,
         .duration = -1,
+        .packet_pool = demux_packet_pool_create(demuxer),
     };
     demuxer->seekable = stream->seekable;
     if (demuxer->stream->underlying && !demuxer->stream->underlying->seekable)
@@ -2264,6 +2743,12 @@ static struct demuxer *open_given_type(struct mpv_global *global,
                 seekable = 1;
         }
         in->seekable_cache = seekable == 1;
+        if (in->seekable_cache && opts->cache_file && opts->cache_file[0]) {
+            in->cache = demux_cache_create(in, global, in->log,
+                                           opts->cache_file,
+                                           opts->cache_file_max);
+            in->cache_max_bytes = opts->cache_file_max;
+        }
         if (!(params && params->disable_timeline)) {
             struct timeline *tl = timeline_load(global, log, demuxer);
             if (tl) {
@@ -2441,12 +2926,20 @@ static void switch_current_range(struct demux_internal *in,
 static struct demux_packet *find_seek_target(struct demux_queue *queue,
                                              double pts, int flags)
 {
+    // Binary search for the last index entry with pts <= target pts, and
+    // start the linear search from there.
     struct demux_packet *start = queue->head;
-    for (int n = 0; n < queue->num_index; n++) {
-        if (queue->index[n]->kf_seek_pts > pts)
-            break;
-        start = queue->index[n];
+    size_t a = 0, b = queue->num_index;
+    while (a < b) {
+        size_t m = a + (b - a) / 2;
+        if (QUEUE_INDEX_ENTRY(queue, m).pts > pts) {
+            b = m;
+        } else {
+            a = m + 1;
+        }
     }
+    if (a > 0)
+        start = QUEUE_INDEX_ENTRY(queue, a - 1).pkt;
 
     struct demux_packet *target = NULL;
     double target_diff = MP_NOPTS_VALUE;
@@ -2650,7 +3143,10 @@ int demux_seek(demuxer_t *demuxer, double seek_pts, int flags)
     in->reading = false;
 
     if (cache_target) {
+        int64_t start = mp_time_us();
         execute_cache_seek(in, cache_target, seek_pts, flags);
+        MP_VERBOSE(in, "cache seek took %f ms\n", (mp_time_us() - start) / 1e3);
+        in->cache_seeks += 1;
     } else {
         switch_to_fresh_cache_range(in);
 
@@ -2700,6 +3196,7 @@ static void initiate_refresh_seek(struct demux_internal *in,
 
     bool normal_seek = true;
     bool refresh_possible = true;
+    sync_all_handoffs(in);
     for (int n = 0; n < in->num_streams; n++) {
         struct demux_stream *ds = in->streams[n]->ds;
 
@@ -2788,6 +3285,26 @@ void demuxer_select_track(struct demuxer *demuxer, struct sh_stream *stream,
     pthread_mutex_unlock(&in->lock);
 }
 
+// Make the demuxer read ahead up to secs seconds or bytes bytes of packets
+// for the selected streams, without waiting for a decoder to request data.
+// This is for prefetching a file that is going to be played later. Call it
+// again with bytes=0 to return to the normal readahead limits.
+void demux_set_prefetch(struct demuxer *demuxer, double secs, int64_t bytes)
+{
+    struct demux_internal *in = demuxer->in;
+    assert(demuxer == in->d_user);
+
+    pthread_mutex_lock(&in->lock);
+    in->prefetch_secs = secs;
+    in->prefetch_bytes = MPMAX(bytes, 0);
+    if (in->prefetch_bytes) {
+        in->reading = true;
+        in->eof = false;
+    }
+    pthread_cond_signal(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
+}
+
 void demux_set_stream_autoselect(struct demuxer *demuxer, bool autoselect)
 {
     assert(!demuxer->in->threading); // laziness
@@ -2976,6 +3493,7 @@ static int cached_demux_control(struct demux_internal *in, int cmd, void *arg)
         double *rates = arg;
         for (int n = 0; n < STREAM_TYPE_COUNT; n++)
             rates[n] = -1;
+        sync_all_handoffs(in);
         for (int n = 0; n < in->num_streams; n++) {
             struct demux_stream *ds = in->streams[n]->ds;
             if (ds->selected && ds->bitrate >= 0)
@@ -2983,28 +3501,63 @@ static int cached_demux_control(struct demux_internal *in, int cmd, void *arg)
         }
         return CONTROL_OK;
     }
+    case DEMUXER_CTRL_GET_CACHE_STATS: {
+        struct demux_ctrl_cache_stats *r = arg;
+        *r = (struct demux_ctrl_cache_stats){
+            .ta_parent = r->ta_parent,
+            .cache_seeks = in->cache_seeks,
+            .low_level_seeks = in->low_level_seeks,
+            .seek_time = in->seek_time_us / 1e6,
+            .seek_time_max = in->seek_time_max_us / 1e6,
+            .pruned_packets = in->pruned_packets,
+            .pruned_bytes = in->pruned_bytes,
+            .evicted_ranges = in->evicted_ranges,
+            .evicted_bytes = in->evicted_bytes,
+        };
+        for (int n = 0; n < in->num_streams; n++) {
+            struct demux_stream *ds = in->streams[n]->ds;
+            if (!ds->selected)
+                continue;
+            struct demux_stream_stats st = {
+                .index = ds->index,
+                .type = ds->type,
+                .underrun_time = ds->underrun_us / 1e6,
+            };
+            for (int i = 0; i < DEMUX_UNDERRUN_BUCKETS; i++)
+                st.underruns[i] = ds->underruns[i];
+            MP_TARRAY_APPEND(r->ta_parent, r->streams, r->num_streams, st);
+        }
+        return CONTROL_OK;
+    }
     case DEMUXER_CTRL_GET_READER_STATE: {
         struct demux_ctrl_reader_state *r = arg;
+        sync_all_handoffs(in);
         *r = (struct demux_ctrl_reader_state){
             .eof = in->last_eof,
             .ts_reader = MP_NOPTS_VALUE,
             .ts_end = MP_NOPTS_VALUE,
             .ts_duration = -1,
             .total_bytes = in->total_bytes,
-            .fw_bytes = in->fw_bytes,
+            .fw_bytes = in->fw_bytes + in->handoff_bytes,
             .seeking = in->seeking_in_progress,
             .low_level_seeks = in->low_level_seeks,
             .ts_last = in->demux_ts,
+            .maint_lock_time = in->maint_lock_us / 1e6,
+            .maint_lock_max = in->maint_lock_max_us / 1e6,
+            .lock_count = in->lock_count,
+            .lock_contended = in->lock_contended,
+            .handoff_reads = atomic_load(&in->handoff_reads),
         };
         bool any_packets = false;
         for (int n = 0; n < in->num_streams; n++) {
             struct demux_stream *ds = in->streams[n]->ds;
             if (ds->eager && !(!ds->queue->head && ds->eof) && !ds->ignore_eof)
             {
-                r->underrun |= !ds->reader_head && !ds->eof && !ds->still_image;
+                bool has_packets = ds->reader_head || ds->handoff_num;
+                r->underrun |= !has_packets && !ds->eof && !ds->still_image;
                 r->ts_reader = MP_PTS_MAX(r->ts_reader, ds->base_ts);
                 r->ts_end = MP_PTS_MAX(r->ts_end, ds->queue->last_ts);
-                any_packets |= !!ds->reader_head;
+                any_packets |= has_packets;
             }
         }
         r->idle = (in->idle && !r->underrun) || r->eof;
@@ -38,6 +38,7 @@ enum demux_ctrl {
     DEMUXER_CTRL_GET_READER_STATE,
     DEMUXER_CTRL_GET_BITRATE_STATS, // double[STREAM_TYPE_COUNT]
     DEMUXER_CTRL_REPLACE_STREAM,
+    DEMUXER_CTRL_GET_CACHE_STATS,   // struct demux_ctrl_cache_stats*
 };
 
 #define MAX_SEEK_RANGES 10
@@ -56,12 +57,43 @@ struct demux_ctrl_reader_state {
     double seeking; // current low level seek target, or NOPTS
     int low_level_seeks; // number of started low level seeks
     double ts_last; // approx. timestamp of demuxer position
+    double maint_lock_time; // total seconds spent joining/pruning with lock held
+    double maint_lock_max; // longest single join/prune operation (seconds)
+    int64_t lock_count; // lock acquisitions for adding/reading packets
+    int64_t lock_contended; // of which had to wait for the lock
+    int64_t handoff_reads; // packets prepared by the demuxer thread
     // Positions that can be seeked to without incurring the latency of a low
     // level seek.
     int num_seek_ranges;
     struct demux_seek_range seek_ranges[MAX_SEEK_RANGES];
 };
 
+// Underrun durations are counted in buckets with these upper limits (seconds);
+// the last bucket counts everything longer.
+#define DEMUX_UNDERRUN_BUCKETS 8
+#define DEMUX_UNDERRUN_LIMITS {0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.0, INFINITY}
+
+struct demux_stream_stats {
+    int index;                  // sh_stream.index
+    enum stream_type type;
+    int64_t underruns[DEMUX_UNDERRUN_BUCKETS];
+    double underrun_time;       // total underrun duration (seconds)
+};
+
+struct demux_ctrl_cache_stats {
+    void *ta_parent;            // input: parent for streams[]
+    int64_t cache_seeks;        // seeks served from the cache
+    int64_t low_level_seeks;    // seeks that had to go to the demuxer
+    double seek_time;           // total time in low level seeks (seconds)
+    double seek_time_max;       // longest low level seek (seconds)
+    int64_t pruned_packets;     // old packets removed to stay in limits
+    int64_t pruned_bytes;
+    int64_t evicted_ranges;     // seek ranges removed to stay in limits
+    int64_t evicted_bytes;
+    struct demux_stream_stats *streams; // for all selected streams
+    int num_streams;
+};
+
 struct demux_ctrl_stream_ctrl {
     int ctrl;
     void *arg;
@@ -223,6 +255,9 @@ typedef struct demuxer {
 
     struct mp_tags *metadata;
 
+    // Recycles small packet buffers; see new_demux_packet_pooled().
+    struct demux_packet_pool *packet_pool;
+
     void *priv;   // demuxer-specific internal data
     struct mpv_global *global;
     struct mp_log *log, *glog;
@@ -249,6 +284,8 @@ void free_demuxer(struct demuxer *demuxer);
 void free_demuxer_and_stream(struct demuxer *demuxer);
 
 void demux_add_packet(struct sh_stream *stream, demux_packet_t *dp);
+void demux_add_packets(struct demuxer *demuxer, struct sh_stream **streams,
+                       struct demux_packet **pkts, int num_pkts);
 void demuxer_feed_caption(struct sh_stream *stream, demux_packet_t *dp);
 
 struct demux_packet *demux_read_packet(struct sh_stream *sh);
@@ -291,6 +328,7 @@ void demux_block_reading(struct demuxer *demuxer, bool block);
 void demuxer_select_track(struct demuxer *demuxer, struct sh_stream *stream,
                           double ref_pts, bool selected);
 void demux_set_stream_autoselect(struct demuxer *demuxer, bool autoselect);
+void demux_set_prefetch(struct demuxer *demuxer, double secs, int64_t bytes);
 
 void demuxer_help(struct mp_log *log);
 
@@ -42,6 +42,7 @@
 #include "common/av_common.h"
 #include "misc/bstr.h"
 #include "misc/charset_conv.h"
+#include "osdep/timer.h"
 
 #include "stream/stream.h"
 #include "demux.h"
@@ -65,6 +66,14 @@
 // libavformat (almost) always reads data in blocks of this size.
 #define BIO_BUFFER_SIZE 32768
 
+// Maximum number of packets read in one demux_lavf_fill_buffer() call.
+#define MAX_BATCH_PACKETS 64
+// Stop batching after this much time (us), so that packets that were already
+// read are not delayed too long if reading blocks (e.g. network).
+#define MAX_BATCH_TIME_US 10000
+// Target duration of a batch (seconds), converted to bytes using the bitrate.
+#define BATCH_SECS 0.05
+
 #define OPT_BASE_STRUCT struct demux_lavf_opts
 struct demux_lavf_opts {
     int probesize;
@@ -72,6 +81,7 @@ struct demux_lavf_opts {
     int probescore;
     float analyzeduration;
     int buffersize;
+    int batch_packets;
     int allow_mimetype;
     char *format;
     char **avopts;
@@ -90,6 +100,8 @@ const struct m_sub_options demux_lavf_conf = {
                        0, 3600),
         OPT_INTRANGE("demuxer-lavf-buffersize", buffersize, 0, 1,
                      10 * 1024 * 1024, OPTDEF_INT(BIO_BUFFER_SIZE)),
+        OPT_INTRANGE("demuxer-lavf-batch-packets", batch_packets, 0,
+                     1, MAX_BATCH_PACKETS),
         OPT_FLAG("demuxer-lavf-allow-mimetype", allow_mimetype, 0),
         OPT_INTRANGE("demuxer-lavf-probescore", probescore, 0,
                      1, AVPROBE_SCORE_MAX),
@@ -106,6 +118,7 @@ const struct m_sub_options demux_lavf_conf = {
     .size = sizeof(struct demux_lavf_opts),
     .defaults = &(const struct demux_lavf_opts){
         .probeinfo = -1,
+        .batch_packets = 8,
         .allow_mimetype = 1,
         .hacks = 1,
         // AVPROBE_SCORE_MAX/4 + 1 is the "recommended" limit. Below that, the
@@ -209,6 +222,12 @@ typedef struct lavf_priv {
 
     struct demux_lavf_opts *opts;
     double mf_fps;
+
+    // Statistics for packet reading (printed on close).
+    int64_t stat_packets;
+    int64_t stat_bytes;
+    int64_t stat_batches;
+    int64_t stat_time_us;       // time spent in av_read_frame()
 } lavf_priv_t;
 
 // At least mp4 has name="mov,mp4,m4a,3gp,3g2,mj2", so we split the name
@@ -980,20 +999,23 @@ static int demux_open_lavf(demuxer_t *demuxer, enum demux_check check)
     return 0;
 }
 
-static int demux_lavf_fill_buffer(demuxer_t *demux)
+// Read a packet. On success, 0 is returned, and *out_dp is set to the packet
+// (or NULL if the packet was skipped). Otherwise, an AVERROR is returned.
+static int read_lavf_packet(demuxer_t *demux, struct sh_stream **out_sh,
+                            struct demux_packet **out_dp)
 {
     lavf_priv_t *priv = demux->priv;
 
+    *out_sh = NULL;
+    *out_dp = NULL;
+
     AVPacket *pkt = &(AVPacket){0};
+    int64_t start = mp_time_us();
     int r = av_read_frame(priv->avfc, pkt);
+    priv->stat_time_us += mp_time_us() - start;
     if (r < 0) {
         av_packet_unref(pkt);
-        if (r == AVERROR(EAGAIN))
-            return 1;
-        if (r == AVERROR_EOF)
-            return 0;
-        MP_WARN(demux, "error reading packet.\n");
-        return -1;
+        return r;
     }
 
     add_new_streams(demux);
@@ -1005,13 +1027,13 @@ static int demux_lavf_fill_buffer(demuxer_t *demux)
 
     if (!demux_stream_is_selected(stream)) {
         av_packet_unref(pkt);
-        return 1; // don't signal EOF if skipping a packet
+        return 0; // don't signal EOF if skipping a packet
     }
 
     struct demux_packet *dp = new_demux_packet_from_avpacket(pkt);
     if (!dp) {
         av_packet_unref(pkt);
-        return 1;
+        return 0;
     }
 
     if (pkt->pts != AV_NOPTS_VALUE)
@@ -1030,8 +1052,60 @@ static int demux_lavf_fill_buffer(demuxer_t *demux)
     if (priv->format_hack.clear_filepos)
         dp->pos = -1;
 
-    demux_add_packet(stream, dp);
-    return 1;
+    *out_sh = stream;
+    *out_dp = dp;
+    return 0;
+}
+
+// Read multiple packets, and add them with a single demux_add_packets() call.
+// The batch is limited by the number of packets, and by the number of bytes
+// corresponding to BATCH_SECS at the file's bitrate (if known).
+static int demux_lavf_fill_buffer(demuxer_t *demux)
+{
+    lavf_priv_t *priv = demux->priv;
+
+    struct sh_stream *streams[MAX_BATCH_PACKETS];
+    struct demux_packet *pkts[MAX_BATCH_PACKETS];
+    int num_pkts = 0;
+
+    int64_t max_bytes = BIO_BUFFER_SIZE;
+    if (priv->avfc->bit_rate > 0)
+        max_bytes = MPMAX(max_bytes, priv->avfc->bit_rate / 8 * BATCH_SECS);
+    int64_t bytes = 0;
+    int64_t start = mp_time_us();
+
+    int r;
+    while (1) {
+        struct sh_stream *sh;
+        struct demux_packet *dp;
+        r = read_lavf_packet(demux, &sh, &dp);
+        if (dp) {
+            streams[num_pkts] = sh;
+            pkts[num_pkts] = dp;
+            num_pkts++;
+            bytes += dp->len;
+        }
+        if (r < 0 || num_pkts >= priv->opts->batch_packets ||
+            bytes >= max_bytes || mp_time_us() - start >= MAX_BATCH_TIME_US ||
+            demux_cancel_test(demux))
+            break;
+    }
+
+    if (num_pkts) {
+        demux_add_packets(demux, streams, pkts, num_pkts);
+        priv->stat_packets += num_pkts;
+        priv->stat_bytes += bytes;
+        priv->stat_batches += 1;
+        // Report errors or EOF on the next call.
+        return 1;
+    }
+
+    if (r == AVERROR(EAGAIN) || r >= 0)
+        return 1;
+    if (r == AVERROR_EOF)
+        return 0;
+    MP_WARN(demux, "error reading packet.\n");
+    return -1;
 }
 
 static void demux_seek_lavf(demuxer_t *demuxer, double seek_pts, int flags)
@@ -1172,6 +1246,13 @@ static void demux_close_lavf(demuxer_t *demuxer)
 {
     lavf_priv_t *priv = demuxer->priv;
     if (priv) {
+        if (priv->stat_bytes) {
+            MP_VERBOSE(demuxer, "Read %"PRId64" packets (%"PRId64" bytes) in "
+                       "%"PRId64" batches, %.3f ms reading (%.3f ms/MB).\n",
+                       priv->stat_packets, priv->stat_bytes, priv->stat_batches,
+                       priv->stat_time_us / 1e3,
+                       priv->stat_time_us / 1e3 / (priv->stat_bytes / 1e6));
+        }
         avformat_close_input(&priv->avfc);
         if (priv->pb)
             av_freep(&priv->pb->buffer);
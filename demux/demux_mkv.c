@@ -26,6 +26,9 @@
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <libavutil/common.h>
 #include <libavutil/lzo.h>
@@ -45,6 +48,8 @@
 #include "common/av_common.h"
 #include "options/m_config.h"
 #include "options/m_option.h"
+#include "options/path.h"
+#include "osdep/io.h"
 #include "misc/bstr.h"
 #include "stream/stream.h"
 #include "video/csputils.h"
@@ -187,6 +192,13 @@ typedef struct mkv_demuxer {
     size_t num_indexes;
     bool index_complete;
     int index_mode;
+    // Whether CUES elements are skipped when encountered (see
+    // read_deferred_cues()).
+    bool defer_cues;
+    // Number of index entries loaded from the index cache, and whether they
+    // were a complete index. Used to avoid rewriting an unchanged cache file.
+    size_t cached_indexes;
+    bool cached_index_complete;
 
     int edition_id;
 
@@ -219,6 +231,9 @@ struct demux_mkv_opts {
     double subtitle_preroll_secs_index;
     int probe_duration;
     int probe_start_time;
+    int lazy_cues;
+    char *index_cache_dir;
+    int slice_laces;
 };
 
 const struct m_sub_options demux_mkv_conf = {
@@ -232,6 +247,9 @@ const struct m_sub_options demux_mkv_conf = {
         OPT_CHOICE("probe-video-duration", probe_duration, 0,
                    ({"no", 0}, {"yes", 1}, {"full", 2})),
         OPT_FLAG("probe-start-time", probe_start_time, 0),
+        OPT_FLAG("lazy-cues", lazy_cues, 0),
+        OPT_STRING("index-cache-dir", index_cache_dir, M_OPT_FILE),
+        OPT_FLAG("slice-laces", slice_laces, 0),
         {0}
     },
     .size = sizeof(struct demux_mkv_opts),
@@ -1244,6 +1262,8 @@ static int demux_mkv_read_seekhead(demuxer_t *demuxer)
 static int read_header_element(struct demuxer *demuxer, uint32_t id,
                                int64_t start_filepos)
 {
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+
     if (id == EBML_ID_INVALID)
         return 0;
 
@@ -1256,6 +1276,11 @@ static int read_header_element(struct demuxer *demuxer, uint32_t id,
     case MATROSKA_ID_TRACKS:
         return demux_mkv_read_tracks(demuxer);
     case MATROSKA_ID_CUES:
+        if (mkv_d->defer_cues) {
+            // Leave it to read_deferred_cues().
+            get_header_element(demuxer, id, start_filepos)->parsed = false;
+            goto skip;
+        }
         return demux_mkv_read_cues(demuxer);
     case MATROSKA_ID_TAGS:
         return demux_mkv_read_tags(demuxer);
@@ -1310,6 +1335,188 @@ static void read_deferred_cues(demuxer_t *demuxer)
     }
 }
 
+// The index cache stores the index of a file (parsed from the cues, or built
+// incrementally while reading blocks) in a separate file, so that reopening
+// the file does not need to read the cues again. Files are identified by
+// segment UID and file size, and additionally by mtime for local files.
+#define INDEX_CACHE_MAGIC "mpvmkvi1"
+
+#define INDEX_CACHE_COMPLETE  (1 << 0)
+#define INDEX_CACHE_DURATIONS (1 << 1)
+
+struct index_cache_header {
+    char magic[8];
+    uint32_t entry_size;        // sizeof(mkv_index_t)
+    uint32_t flags;             // INDEX_CACHE_* flags
+    int64_t file_size;
+    int64_t mtime;              // -1 if unknown
+    int64_t segment_start;
+    uint64_t num_entries;       // number of mkv_index_t following the header
+};
+
+static char *get_index_cache_path(void *ta_ctx, struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    char *dir = mkv_d->opts->index_cache_dir;
+
+    if (!dir || !dir[0])
+        return NULL;
+
+    unsigned char *uid = demuxer->matroska_data.uid.segment;
+    int uid_len = sizeof(demuxer->matroska_data.uid.segment);
+    bool have_uid = false;
+    for (int n = 0; n < uid_len; n++)
+        have_uid |= uid[n];
+    int64_t size = stream_get_size(demuxer->stream);
+    if (!have_uid || size <= 0)
+        return NULL;
+
+    char *name = talloc_strdup(ta_ctx, "");
+    for (int n = 0; n < uid_len; n++)
+        name = talloc_asprintf_append(name, "%02x", uid[n]);
+    name = talloc_asprintf_append(name, "-%"PRIx64".idx", size);
+
+    char *path = mp_get_user_path(ta_ctx, demuxer->global, dir);
+    return mp_path_join(ta_ctx, path, name);
+}
+
+static int64_t get_file_mtime(struct stream *s)
+{
+    struct stat st;
+    if (s->is_local_file && s->path && stat(s->path, &st) == 0)
+        return st.st_mtime;
+    return -1;
+}
+
+// Try to load the index from the index cache. Returns whether it was loaded.
+static bool load_index_cache(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    void *tmp = talloc_new(NULL);
+    bool ok = false;
+    FILE *f = NULL;
+
+    char *path = get_index_cache_path(tmp, demuxer);
+    if (!path)
+        goto done;
+
+    f = fopen(path, "rb");
+    if (!f)
+        goto done;
+
+    struct index_cache_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+        goto done;
+    if (memcmp(hdr.magic, INDEX_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.entry_size != sizeof(mkv_index_t) ||
+        hdr.file_size != stream_get_size(demuxer->stream) ||
+        hdr.mtime != get_file_mtime(demuxer->stream) ||
+        hdr.segment_start != mkv_d->segment_start ||
+        hdr.num_entries < 1 || hdr.num_entries > SIZE_MAX / sizeof(mkv_index_t))
+    {
+        MP_VERBOSE(demuxer, "Ignoring outdated index cache file.\n");
+        goto done;
+    }
+
+    mkv_index_t *indexes = talloc_array(tmp, mkv_index_t, hdr.num_entries);
+    if (fread(indexes, sizeof(mkv_index_t), hdr.num_entries, f) !=
+        hdr.num_entries)
+        goto done;
+
+    for (size_t n = 0; n < hdr.num_entries; n++) {
+        if (indexes[n].filepos < mkv_d->segment_start ||
+            indexes[n].filepos >= hdr.file_size)
+            goto done;
+    }
+
+    MP_VERBOSE(demuxer, "Loaded %"PRIu64" index entries from '%s'.\n",
+               hdr.num_entries, path);
+
+    talloc_free(mkv_d->indexes);
+    mkv_d->indexes = talloc_steal(mkv_d, indexes);
+    mkv_d->num_indexes = hdr.num_entries;
+    mkv_d->index_complete = hdr.flags & INDEX_CACHE_COMPLETE;
+    mkv_d->index_has_durations = hdr.flags & INDEX_CACHE_DURATIONS;
+    mkv_d->cached_indexes = mkv_d->num_indexes;
+    mkv_d->cached_index_complete = mkv_d->index_complete;
+
+    // Continue the incremental index where it was left off.
+    for (int i = 0; i < mkv_d->num_tracks; i++) {
+        mkv_track_t *track = mkv_d->tracks[i];
+        track->last_index_entry = (size_t)-1;
+        if (mkv_d->index_complete)
+            continue;
+        for (size_t n = 0; n < mkv_d->num_indexes; n++) {
+            if (mkv_d->indexes[n].tnum == track->tnum)
+                track->last_index_entry = n;
+        }
+    }
+
+    ok = true;
+done:
+    if (f)
+        fclose(f);
+    talloc_free(tmp);
+    return ok;
+}
+
+// Write the current index to the index cache, if it's useful.
+static void save_index_cache(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+
+    // Only a single entry is the start of the file (useless).
+    if (mkv_d->num_indexes < 2)
+        return;
+    // Unchanged since it was loaded?
+    if (mkv_d->cached_indexes == mkv_d->num_indexes &&
+        mkv_d->cached_index_complete == mkv_d->index_complete)
+        return;
+
+    void *tmp = talloc_new(NULL);
+    char *path = get_index_cache_path(tmp, demuxer);
+    if (!path)
+        goto done;
+
+    mp_mkdirp(mp_get_user_path(tmp, demuxer->global,
+                               mkv_d->opts->index_cache_dir));
+
+    struct index_cache_header hdr = {
+        .magic = INDEX_CACHE_MAGIC,
+        .entry_size = sizeof(mkv_index_t),
+        .flags = (mkv_d->index_complete ? INDEX_CACHE_COMPLETE : 0) |
+                 (mkv_d->index_has_durations ? INDEX_CACHE_DURATIONS : 0),
+        .file_size = stream_get_size(demuxer->stream),
+        .mtime = get_file_mtime(demuxer->stream),
+        .segment_start = mkv_d->segment_start,
+        .num_entries = mkv_d->num_indexes,
+    };
+
+    // Write to a temporary file first, so that concurrent readers never see
+    // a partially written file.
+    char *tmp_path = talloc_asprintf(tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+        goto error;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+              fwrite(mkv_d->indexes, sizeof(mkv_index_t), mkv_d->num_indexes,
+                     f) == mkv_d->num_indexes;
+    ok &= fclose(f) == 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        goto error;
+    }
+
+    MP_VERBOSE(demuxer, "Wrote %zu index entries to '%s'.\n",
+               mkv_d->num_indexes, path);
+    goto done;
+
+error:
+    MP_WARN(demuxer, "Could not write index cache file '%s'.\n", path);
+done:
+    talloc_free(tmp);
+}
+
 static void add_coverart(struct demuxer *demuxer)
 {
     for (int n = 0; n < demuxer->num_attachments; n++) {
@@ -2038,6 +2245,13 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
                        &mkv_d->edition_id);
     mkv_d->opts = mp_get_config_group(mkv_d, demuxer->global, &demux_mkv_conf);
 
+    // Postpone reading the cues until it's known whether the index cache can
+    // be used instead.
+    bool use_index_cache = mkv_d->opts->index_cache_dir &&
+                           mkv_d->opts->index_cache_dir[0];
+    mkv_d->defer_cues = mkv_d->index_mode == 1 &&
+                        (use_index_cache || mkv_d->opts->lazy_cues);
+
     if (demuxer->params && demuxer->params->matroska_was_valid)
         *demuxer->params->matroska_was_valid = true;
 
@@ -2095,6 +2309,8 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
                 struct header_elem *elem = &mkv_d->headers[n];
                 if (elem->parsed)
                     continue;
+                if (mkv_d->defer_cues && elem->id == MATROSKA_ID_CUES)
+                    continue;
                 if (!lowest || elem->pos < lowest->pos)
                     lowest = elem;
             }
@@ -2107,6 +2323,23 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
         }
     }
 
+    if (mkv_d->defer_cues) {
+        mkv_d->defer_cues = false;
+        if (use_index_cache && load_index_cache(demuxer) &&
+            mkv_d->index_complete)
+        {
+            // The cues were already parsed into the cached index.
+            for (int n = 0; n < mkv_d->num_headers; n++) {
+                if (mkv_d->headers[n].id == MATROSKA_ID_CUES)
+                    mkv_d->headers[n].parsed = true;
+            }
+        } else if (mkv_d->opts->lazy_cues) {
+            MP_VERBOSE(demuxer, "Deferring reading cues until first seek.\n");
+        } else if (only_cue != 1) {
+            read_deferred_cues(demuxer);
+        }
+    }
+
     if (!stream_seek(s, start_pos)) {
         MP_ERR(demuxer, "Couldn't seek back after reading headers?\n");
         return -1;
@@ -2126,10 +2359,55 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
     return 0;
 }
 
+// Read all laces into a single buffer, and make each lace a reference to a
+// part of it. Each lace is followed by its own zeroed padding.
+static int read_sliced_laces(struct block_info *block, struct stream *s,
+                             uint64_t endpos, uint32_t *lace_size, int laces)
+{
+    int64_t size = endpos - stream_tell(s);
+    if (size < 0 || size > (1 << 30))
+        return 1;
+    int64_t total = 0;
+    for (int i = 0; i < laces; i++)
+        total += lace_size[i];
+    if (total != size)
+        return 1;
+    int pad = MPMAX(AV_INPUT_BUFFER_PADDING_SIZE, AV_LZO_INPUT_PADDING);
+    AVBufferRef *buf = av_buffer_alloc(size + laces * pad);
+    if (!buf)
+        return 1;
+    int r = 1;
+    struct stream_iovec iov[MAX_NUM_LACES];
+    int64_t offset = 0;
+    for (int i = 0; i < laces; i++) {
+        iov[i] = (struct stream_iovec){buf->data + offset, lace_size[i]};
+        offset += lace_size[i];
+        memset(buf->data + offset, 0, pad);
+        offset += pad;
+    }
+    if (stream_read_v(s, iov, laces) != size)
+        goto done;
+
+    for (int i = 0; i < laces; i++) {
+        AVBufferRef *ref = av_buffer_ref(buf);
+        if (!ref)
+            goto done;
+        ref->data = iov[i].data;
+        ref->size = iov[i].len;
+        block->laces[block->num_laces++] = ref;
+    }
+    r = 0;
+
+done:
+    av_buffer_unref(&buf);
+    return r;
+}
+
 // Read the laced block data at the current stream position (until endpos as
 // indicated by the block length field) into individual buffers.
 static int demux_mkv_read_block_lacing(struct block_info *block, int type,
-                                       struct stream *s, uint64_t endpos)
+                                       struct stream *s, uint64_t endpos,
+                                       bool slice)
 {
     int laces;
     uint32_t lace_size[MAX_NUM_LACES];
@@ -2193,22 +2471,28 @@ static int demux_mkv_read_block_lacing(struct block_info *block, int type,
         }
     }
 
+    if (slice && laces > 1)
+        return read_sliced_laces(block, s, endpos, lace_size, laces);
+
+    // Allocate all lace buffers first, so that they can be read at once.
+    struct stream_iovec iov[MAX_NUM_LACES];
+    int64_t total = 0;
     for (int i = 0; i < laces; i++) {
         uint32_t size = lace_size[i];
-        if (stream_tell(s) + size > endpos || size > (1 << 30))
+        total += size;
+        if (stream_tell(s) + total > endpos || total > (1 << 30))
             goto error;
         int pad = MPMAX(AV_INPUT_BUFFER_PADDING_SIZE, AV_LZO_INPUT_PADDING);
         AVBufferRef *buf = av_buffer_alloc(size + pad);
         if (!buf)
             goto error;
         buf->size = size;
-        if (stream_read(s, buf->data, buf->size) != buf->size) {
-            av_buffer_unref(&buf);
-            goto error;
-        }
         memset(buf->data + buf->size, 0, pad);
         block->laces[block->num_laces++] = buf;
+        iov[i] = (struct stream_iovec){.data = buf->data, .len = size};
     }
+    if (stream_read_v(s, iov, laces) != total)
+        goto error;
 
     if (stream_tell(s) != endpos)
         goto error;
@@ -2302,8 +2586,9 @@ static bool handle_realaudio(demuxer_t *demuxer, mkv_track_t *track,
             goto error;
         // Release all the audio packets
         for (int x = 0; x < sph * w / apk_usize; x++) {
-            dp = new_demux_packet_from(track->audio_buf + x * apk_usize,
-                                        apk_usize);
+            dp = new_demux_packet_from_pooled(demuxer->packet_pool,
+                                              track->audio_buf + x * apk_usize,
+                                              apk_usize);
             if (!dp)
                 goto error;
             /* Put timestamp only on packets that correspond to original
@@ -2436,7 +2721,8 @@ static void mkv_parse_and_add_packet(demuxer_t *demuxer, mkv_track_t *track,
         int size = dp->len;
         uint8_t *parsed;
         if (libav_parse_wavpack(track, dp->buffer, &parsed, &size) >= 0) {
-            struct demux_packet *new = new_demux_packet_from(parsed, size);
+            struct demux_packet *new =
+                new_demux_packet_from_pooled(demuxer->packet_pool, parsed, size);
             if (new) {
                 demux_packet_copy_attribs(new, dp);
                 talloc_free(dp);
@@ -2490,7 +2776,8 @@ static void mkv_parse_and_add_packet(demuxer_t *demuxer, mkv_track_t *track,
         dp->len -= len;
         dp->pos += len;
         if (size) {
-            struct demux_packet *new = new_demux_packet_from(data, size);
+            struct demux_packet *new =
+                new_demux_packet_from_pooled(demuxer->packet_pool, data, size);
             if (!new)
                 break;
             if (copy_sidedata)
@@ -2567,7 +2854,8 @@ static int read_block(demuxer_t *demuxer, int64_t end, struct block_info *block)
     block->filepos = stream_tell(s);
 
     int lace_type = (header_flags >> 1) & 0x03;
-    if (demux_mkv_read_block_lacing(block, lace_type, s, endpos))
+    if (demux_mkv_read_block_lacing(block, lace_type, s, endpos,
+                                    mkv_d->opts->slice_laces))
         goto exit;
 
     if (block->simple)
@@ -2663,7 +2951,8 @@ static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
 
             if (block.start != nblock.start || block.len != nblock.len) {
                 // (avoidable copy of the entire data)
-                dp = new_demux_packet_from(nblock.start, nblock.len);
+                dp = new_demux_packet_from_pooled(demuxer->packet_pool,
+                                                  nblock.start, nblock.len);
             } else {
                 dp = new_demux_packet_from_buf(data);
             }
@@ -3229,6 +3518,9 @@ static void mkv_free(struct demuxer *demuxer)
     struct mkv_demuxer *mkv_d = demuxer->priv;
     if (!mkv_d)
         return;
+    if (mkv_d->opts->index_cache_dir && mkv_d->opts->index_cache_dir[0] &&
+        mkv_d->index_mode == 1)
+        save_index_cache(demuxer);
     mkv_seek_reset(demuxer);
     for (int i = 0; i < mkv_d->num_tracks; i++)
         demux_mkv_free_trackentry(mkv_d->tracks[i]);
@@ -17,15 +17,36 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "common/common.h"
 #include "common/msg.h"
+#include "misc/thread_pool.h"
+#include "options/m_config.h"
+#include "options/m_option.h"
+#include "osdep/timer.h"
 
 #include "demux.h"
 #include "timeline.h"
 #include "stheader.h"
 #include "stream/stream.h"
 
+#define OPT_BASE_STRUCT struct demux_timeline_opts
+struct demux_timeline_opts {
+    int preload;
+};
+
+const struct m_sub_options demux_timeline_conf = {
+    .opts = (const m_option_t[]) {
+        OPT_INTRANGE("preload", preload, 0, 0, 16),
+        {0}
+    },
+    .size = sizeof(struct demux_timeline_opts),
+    .defaults = &(const struct demux_timeline_opts){
+        .preload = 1,
+    },
+};
+
 struct segment {
     int index;
     double start, end;
@@ -33,6 +54,7 @@ struct segment {
     char *url;
     bool lazy;
     struct demuxer *d;
+    struct open_job *job;   // if non-NULL, d is being opened in the background
     // stream_map[sh_stream.index] = index into priv.streams, where sh_stream
     // is a stream from the source d. It's used to map the streams of the
     // source onto the set of streams of the virtual timeline.
@@ -49,8 +71,27 @@ struct virtual_stream {
     int eos_packets;            // deal with b-frame delay
 };
 
+// A lazy segment opened on a worker thread.
+struct open_job {
+    struct priv *p;
+    struct mpv_global *global;
+    struct mp_cancel *cancel;
+    char *url;
+
+    // --- protected by priv.lock
+    bool done;                  // open attempt finished
+    bool abandoned;             // job owns itself, and frees itself when done
+    struct demuxer *d;          // result (NULL on failure)
+};
+
 struct priv {
     struct timeline *tl;
+    struct demux_timeline_opts *opts;
+
+    // For opening the next segments in the background.
+    struct mp_thread_pool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
 
     double duration;
     bool dash;
@@ -139,20 +180,140 @@ static void reselect_streams(struct demuxer *demuxer)
     }
 }
 
+static void open_job_run(void *ctx)
+{
+    struct open_job *job = ctx;
+    struct priv *p = job->p;
+
+    struct demuxer_params params = {
+        .init_fragment = p->tl->init_fragment,
+        .skip_lavf_probing = true,
+    };
+    struct demuxer *d = demux_open_url(job->url, &params, job->cancel,
+                                       job->global);
+    if (d)
+        demux_disable_cache(d);
+
+    pthread_mutex_lock(&p->lock);
+    bool abandoned = job->abandoned;
+    job->d = d;
+    job->done = true;
+    pthread_cond_broadcast(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+
+    if (abandoned) {
+        if (d)
+            free_demuxer_and_stream(d);
+        talloc_free(job);
+    }
+}
+
+// Stop opening the segment in the background (or free the result).
+static void abandon_job(struct priv *p, struct segment *seg)
+{
+    struct open_job *job = seg->job;
+    if (!job)
+        return;
+    seg->job = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    bool done = job->done;
+    job->abandoned = true;
+    pthread_mutex_unlock(&p->lock);
+
+    if (done) {
+        if (job->d)
+            free_demuxer_and_stream(job->d);
+        talloc_free(job);
+    } else {
+        mp_cancel_trigger(job->cancel);
+    }
+}
+
+// Wait until the background open of the segment has finished, and take over
+// the result. Gives up if the timeline demuxer is cancelled.
+static void finish_job(struct demuxer *demuxer, struct segment *seg)
+{
+    struct priv *p = demuxer->priv;
+    struct open_job *job = seg->job;
+
+    pthread_mutex_lock(&p->lock);
+    if (!job->done)
+        MP_VERBOSE(demuxer, "waiting for segment %d\n", seg->index);
+    while (!job->done && !demux_cancel_test(demuxer)) {
+        struct timespec ts = mp_rel_time_to_timespec(0.05);
+        pthread_cond_timedwait(&p->wakeup, &p->lock, &ts);
+    }
+    bool done = job->done;
+    pthread_mutex_unlock(&p->lock);
+
+    if (!done) {
+        abandon_job(p, seg);
+        return;
+    }
+
+    seg->job = NULL;
+    seg->d = job->d;
+    talloc_free(job);
+}
+
+// Whether the segment is the current one, or one of the next segments that
+// are opened ahead of time.
+static bool in_preload_window(struct priv *p, struct segment *seg)
+{
+    return p->current && seg->index >= p->current->index &&
+           seg->index <= p->current->index + p->opts->preload;
+}
+
 static void close_lazy_segments(struct demuxer *demuxer)
 {
     struct priv *p = demuxer->priv;
 
-    // unload previous segment
+    // unload previous segment, and segments too far ahead
     for (int n = 0; n < p->num_segments; n++) {
         struct segment *seg = p->segments[n];
-        if (seg != p->current && seg->d && seg->lazy) {
+        if (in_preload_window(p, seg))
+            continue;
+        abandon_job(p, seg);
+        if (seg->d && seg->lazy) {
             free_demuxer_and_stream(seg->d);
             seg->d = NULL;
         }
     }
 }
 
+// Start opening the lazy segments following the current one on worker threads,
+// so that switching to them does not need to wait for opening the file.
+static void preload_segments(struct demuxer *demuxer)
+{
+    struct priv *p = demuxer->priv;
+
+    close_lazy_segments(demuxer);
+
+    if (!p->pool || !p->current)
+        return;
+
+    for (int n = 0; n < p->num_segments; n++) {
+        struct segment *seg = p->segments[n];
+        if (seg == p->current || !in_preload_window(p, seg))
+            continue;
+        if (!seg->lazy || seg->d || seg->job)
+            continue;
+
+        MP_VERBOSE(demuxer, "preloading segment %d\n", seg->index);
+
+        struct open_job *job = talloc_ptrtype(NULL, job);
+        *job = (struct open_job){
+            .p = p,
+            .global = demuxer->global,
+            .cancel = mp_cancel_new(job),
+            .url = talloc_strdup(job, seg->url),
+        };
+        seg->job = job;
+        mp_thread_pool_queue(p->pool, open_job_run, job);
+    }
+}
+
 static void reopen_lazy_segments(struct demuxer *demuxer)
 {
     struct priv *p = demuxer->priv;
@@ -162,16 +323,20 @@ static void reopen_lazy_segments(struct demuxer *demuxer)
 
     close_lazy_segments(demuxer);
 
-    struct demuxer_params params = {
-        .init_fragment = p->tl->init_fragment,
-        .skip_lavf_probing = true,
-    };
-    p->current->d = demux_open_url(p->current->url, &params,
-                                   demuxer->stream->cancel, demuxer->global);
+    if (p->current->job) {
+        finish_job(demuxer, p->current);
+    } else {
+        struct demuxer_params params = {
+            .init_fragment = p->tl->init_fragment,
+            .skip_lavf_probing = true,
+        };
+        p->current->d = demux_open_url(p->current->url, &params,
+                                       demuxer->stream->cancel, demuxer->global);
+        if (p->current->d)
+            demux_disable_cache(p->current->d);
+    }
     if (!p->current->d && !demux_cancel_test(demuxer))
         MP_ERR(demuxer, "failed to load segment\n");
-    if (p->current->d)
-        demux_disable_cache(p->current->d);
     associate_streams(demuxer, p->current);
 }
 
@@ -187,6 +352,7 @@ static void switch_segment(struct demuxer *demuxer, struct segment *new,
 
     p->current = new;
     reopen_lazy_segments(demuxer);
+    preload_segments(demuxer);
     if (!new->d)
         return;
     reselect_streams(demuxer);
@@ -348,6 +514,10 @@ static int d_open(struct demuxer *demuxer, enum demux_check check)
     if (!p->tl || p->tl->num_parts < 1)
         return -1;
 
+    p->opts = mp_get_config_group(p, demuxer->global, &demux_timeline_conf);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wakeup, NULL);
+
     p->duration = p->tl->parts[p->tl->num_parts].start;
 
     demuxer->chapters = p->tl->chapters;
@@ -410,6 +580,15 @@ static int d_open(struct demuxer *demuxer, enum demux_check check)
 
     p->dash = p->tl->dash;
 
+    bool any_lazy = false;
+    for (int n = 0; n < p->num_segments; n++)
+        any_lazy |= p->segments[n]->lazy;
+    if (any_lazy && p->opts->preload > 0) {
+        p->pool = mp_thread_pool_create(p, p->opts->preload);
+        if (!p->pool)
+            MP_WARN(demuxer, "could not create threads for preloading\n");
+    }
+
     print_timeline(demuxer);
 
     demuxer->seekable = true;
@@ -430,6 +609,11 @@ static void d_close(struct demuxer *demuxer)
     struct demuxer *master = p->tl->demuxer;
     p->current = NULL;
     close_lazy_segments(demuxer);
+    // Wait for abandoned background opens.
+    talloc_free(p->pool);
+    p->pool = NULL;
+    pthread_cond_destroy(&p->wakeup);
+    pthread_mutex_destroy(&p->lock);
     timeline_destroy(p->tl);
     free_demuxer(master);
 }
@@ -203,14 +203,21 @@ int ebml_resync_cluster(struct mp_log *log, stream_t *s)
                "Trying to resync starting from position %"PRId64"...\n", pos);
     }
     while (!s->eof) {
-        // Assumes MATROSKA_ID_CLUSTER is 4 bytes, with no 0 bytes.
-        if (last_4_bytes == MATROSKA_ID_CLUSTER) {
-            mp_err(log, "Cluster found at %"PRId64".\n", pos - 4);
-            stream_seek(s, pos - 4);
-            return 0;
+        // Scan the data in place instead of reading it byte by byte.
+        unsigned char *data;
+        int len = stream_borrow(s, 64 * 1024, &data);
+        if (!len)
+            break;
+        for (int n = 0; n < len; n++) {
+            last_4_bytes = (last_4_bytes << 8) | data[n];
+            pos++;
+            // Assumes MATROSKA_ID_CLUSTER is 4 bytes, with no 0 bytes.
+            if (last_4_bytes == MATROSKA_ID_CLUSTER) {
+                mp_err(log, "Cluster found at %"PRId64".\n", pos - 4);
+                stream_seek(s, pos - 4);
+                return 0;
+            }
         }
-        last_4_bytes = (last_4_bytes << 8) | stream_read_char(s);
-        pos++;
     }
     return -1;
 }
@@ -31,10 +31,36 @@
 
 #include "packet.h"
 
+// The packet struct and its AVPacket are allocated as a single block.
+struct packet_alloc {
+    struct demux_packet dp;
+    AVPacket avpacket;
+};
+
+// Small payloads are allocated from size classes POOL_MIN_SIZE << n.
+#define POOL_MIN_SIZE 256
+#define POOL_NUM_CLASSES 9 // up to 64 KiB
+
+struct demux_packet_pool {
+    AVBufferPool *pools[POOL_NUM_CLASSES];
+};
+
+// Return the size class for an allocation of the given size, or -1 if it's
+// too large for the pool.
+static int pool_class(size_t size)
+{
+    for (int n = 0; n < POOL_NUM_CLASSES; n++) {
+        if (size <= ((size_t)POOL_MIN_SIZE << n))
+            return n;
+    }
+    return -1;
+}
+
 static void packet_destroy(void *ptr)
 {
     struct demux_packet *dp = ptr;
-    av_packet_unref(dp->avpacket);
+    if (dp->avpacket)
+        av_packet_unref(dp->avpacket);
     mp_packet_tags_unref(dp->metadata);
 }
 
@@ -45,7 +71,8 @@ struct demux_packet *new_demux_packet_from_avpacket(struct AVPacket *avpkt)
 {
     if (avpkt->size > 1000000000)
         return NULL;
-    struct demux_packet *dp = talloc(NULL, struct demux_packet);
+    struct packet_alloc *alloc = talloc(NULL, struct packet_alloc);
+    struct demux_packet *dp = &alloc->dp;
     talloc_set_destructor(dp, packet_destroy);
     *dp = (struct demux_packet) {
         .pts = MP_NOPTS_VALUE,
@@ -55,8 +82,9 @@ struct demux_packet *new_demux_packet_from_avpacket(struct AVPacket *avpkt)
         .start = MP_NOPTS_VALUE,
         .end = MP_NOPTS_VALUE,
         .stream = -1,
-        .avpacket = talloc_zero(dp, AVPacket),
+        .avpacket = &alloc->avpacket,
         .kf_seek_pts = MP_NOPTS_VALUE,
+        .cached_pos = -1,
     };
     av_init_packet(dp->avpacket);
     int r = -1;
@@ -107,6 +135,62 @@ struct demux_packet *new_demux_packet(size_t len)
     return new_demux_packet_from_avpacket(&pkt);
 }
 
+static void pool_destroy(void *ptr)
+{
+    struct demux_packet_pool *pool = ptr;
+    // Buffers still referenced by packets keep the pools alive.
+    for (int n = 0; n < POOL_NUM_CLASSES; n++)
+        av_buffer_pool_uninit(&pool->pools[n]);
+}
+
+// Create a pool for packet payloads. It's not thread-safe, so it should be
+// used by a single demuxer (packets allocated from it can be freed from any
+// thread, and can outlive the pool).
+struct demux_packet_pool *demux_packet_pool_create(void *ta_parent)
+{
+    struct demux_packet_pool *pool = talloc_zero(ta_parent, struct demux_packet_pool);
+    talloc_set_destructor(pool, pool_destroy);
+    return pool;
+}
+
+// Like new_demux_packet(), but small payload buffers are recycled through the
+// given pool, which avoids malloc/free churn at high packet rates. pool can be
+// NULL, in which case this is the same as new_demux_packet().
+struct demux_packet *new_demux_packet_pooled(struct demux_packet_pool *pool,
+                                             size_t len)
+{
+    int cls = pool ? pool_class(len + AV_INPUT_BUFFER_PADDING_SIZE) : -1;
+    if (cls < 0)
+        return new_demux_packet(len);
+
+    if (!pool->pools[cls]) {
+        pool->pools[cls] = av_buffer_pool_init(POOL_MIN_SIZE << cls, NULL);
+        if (!pool->pools[cls])
+            return NULL;
+    }
+
+    AVBufferRef *buf = av_buffer_pool_get(pool->pools[cls]);
+    if (!buf)
+        return NULL;
+    memset(buf->data + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    AVPacket pkt = { .buf = buf, .data = buf->data, .size = len };
+    struct demux_packet *dp = new_demux_packet_from_avpacket(&pkt);
+    av_buffer_unref(&buf);
+    if (dp)
+        dp->pooled = true;
+    return dp;
+}
+
+// Like new_demux_packet_from(), but see new_demux_packet_pooled().
+struct demux_packet *new_demux_packet_from_pooled(struct demux_packet_pool *pool,
+                                                  void *data, size_t len)
+{
+    struct demux_packet *dp = new_demux_packet_pooled(pool, len);
+    if (dp)
+        memcpy(dp->buffer, data, len);
+    return dp;
+}
+
 void demux_packet_shorten(struct demux_packet *dp, size_t len)
 {
     assert(len <= dp->len);
@@ -114,6 +198,17 @@ void demux_packet_shorten(struct demux_packet *dp, size_t len)
     dp->len = dp->avpacket->size;
 }
 
+// Free the packet data and side data, but keep the packet struct itself with
+// all its metadata. dp->len is preserved, but dp->buffer is unset.
+void demux_packet_unref_contents(struct demux_packet *dp)
+{
+    if (dp->avpacket) {
+        av_packet_unref(dp->avpacket);
+        dp->avpacket = NULL;
+    }
+    dp->buffer = NULL;
+}
+
 void free_demux_packet(struct demux_packet *dp)
 {
     talloc_free(dp);
@@ -139,6 +234,8 @@ struct demux_packet *demux_copy_packet(struct demux_packet *dp)
     struct demux_packet *new = NULL;
     if (dp->avpacket) {
         new = new_demux_packet_from_avpacket(dp->avpacket);
+        if (new)
+            new->pooled = dp->pooled; // references the same buffer
     } else {
         // Some packets might be not created by new_demux_packet*().
         new = new_demux_packet_from(dp->buffer, dp->len);
@@ -161,10 +258,17 @@ struct demux_packet *demux_copy_packet(struct demux_packet *dp)
 // memory wasted due to internal fragmentation.)
 size_t demux_packet_estimate_total_size(struct demux_packet *dp)
 {
-    size_t size = ROUND_ALLOC(sizeof(struct demux_packet));
-    size += ROUND_ALLOC(dp->len);
+    size_t size = ROUND_ALLOC(sizeof(struct packet_alloc));
+    if (dp->is_cached)
+        return size; // data was moved to the disk cache
+    size_t buf_size = dp->len + AV_INPUT_BUFFER_PADDING_SIZE;
+    int cls = dp->pooled ? pool_class(buf_size) : -1;
+    if (cls >= 0) {
+        size += (size_t)POOL_MIN_SIZE << cls; // the whole size class is used
+    } else {
+        size += ROUND_ALLOC(buf_size);
+    }
     if (dp->avpacket) {
-        size += ROUND_ALLOC(sizeof(AVPacket));
         size += ROUND_ALLOC(sizeof(AVBufferRef));
         size += 64; // upper bound estimate on sizeof(AVBuffer)
         size += ROUND_ALLOC(dp->avpacket->side_data_elems *
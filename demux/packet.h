@@ -45,15 +45,26 @@ typedef struct demux_packet {
     struct AVPacket *avpacket;   // keep the buffer allocation and sidedata
     double kf_seek_pts; // demux.c internal: seek pts for keyframe range
     struct mp_packet_tags *metadata; // timed metadata (demux.c internal)
+    int64_t cached_pos; // demux.c internal: position in disk cache, or -1
+    bool is_cached;     // demux.c internal: data exists in disk cache only
+    bool pooled;        // buffer was allocated from a demux_packet_pool
 } demux_packet_t;
 
 struct AVBufferRef;
+struct demux_packet_pool;
+
+struct demux_packet_pool *demux_packet_pool_create(void *ta_parent);
+struct demux_packet *new_demux_packet_pooled(struct demux_packet_pool *pool,
+                                             size_t len);
+struct demux_packet *new_demux_packet_from_pooled(struct demux_packet_pool *pool,
+                                                  void *data, size_t len);
 
 struct demux_packet *new_demux_packet(size_t len);
 struct demux_packet *new_demux_packet_from_avpacket(struct AVPacket *avpkt);
 struct demux_packet *new_demux_packet_from(void *data, size_t len);
 struct demux_packet *new_demux_packet_from_buf(struct AVBufferRef *buf);
 void demux_packet_shorten(struct demux_packet *dp, size_t len);
+void demux_packet_unref_contents(struct demux_packet *dp);
 void free_demux_packet(struct demux_packet *dp);
 struct demux_packet *demux_copy_packet(struct demux_packet *dp);
 size_t demux_packet_estimate_total_size(struct demux_packet *dp);
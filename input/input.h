@@ -217,15 +217,38 @@ struct mp_client_api;
 // Platform specific implementation, provided by ipc-*.c.
 struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
                                struct mpv_global *global);
-void mp_uninit_ipc(struct mp_ipc_ctx *ctx);
+// Stop the IPC server. With wait=true, wait until its threads have exited,
+// which requires that all clients were shut down (mp_shutdown_clients()).
+// Otherwise, existing clients may be served in the background until they
+// disconnect.
+void mp_uninit_ipc(struct mp_ipc_ctx *ctx, bool wait);
+
+enum mp_ipc_protocol {
+    MP_IPC_PROTOCOL_JSON,       // newline-separated JSON and text commands
+    MP_IPC_PROTOCOL_MSGPACK,    // msgpack, framed with a 32 bit length prefix
+};
 
-// Serialize the given mpv_event structure to JSON. Returns an allocated string.
-struct mpv_event;
-char *mp_json_encode_event(struct mpv_event *event);
+// Larger msgpack frames are rejected by mp_ipc_has_command().
+#define MP_IPC_MAX_FRAME_SIZE (64 * 1024 * 1024)
 
-// Given the raw IPC input buffer "buf", remove the first newline-separated
-// command, execute it and return the result (if any) as an allocated string.
+// Serialize the given mpv_event structure in the given protocol, including
+// the message framing. Returns an allocated string, or {0} on error.
+struct mpv_event;
+bstr mp_ipc_encode_event(void *ta_parent, struct mpv_event *event,
+                         enum mp_ipc_protocol protocol);
+
+// Return 1 if the raw IPC input buffer "buf" contains a complete command,
+// 0 if more data is needed, and -1 if the input is broken beyond recovery (the
+// connection should be closed).
+int mp_ipc_has_command(bstr buf, enum mp_ipc_protocol protocol);
+
+// Given the raw IPC input buffer "buf", remove the first command, execute it
+// and return the result (if any) as an allocated string (with .start==NULL if
+// there is no reply). mp_ipc_has_command() must have returned 1. *protocol
+// is the current protocol of the connection, and is updated if the command
+// switches it.
 struct mpv_handle;
-char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *buf);
+bstr mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx,
+                                 bstr *buf, enum mp_ipc_protocol *protocol);
 
 #endif /* MPLAYER_INPUT_H */
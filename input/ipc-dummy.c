@@ -8,6 +8,6 @@ struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
     return NULL;
 }
 
-void mp_uninit_ipc(struct mp_ipc_ctx *ctx)
+void mp_uninit_ipc(struct mp_ipc_ctx *ctx, bool wait)
 {
 }
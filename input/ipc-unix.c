@@ -28,6 +28,7 @@
 
 #include "config.h"
 
+#include "osdep/atomic.h"
 #include "osdep/io.h"
 #include "osdep/threads.h"
 
@@ -44,13 +45,31 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+// If a client has more unsent output than this, stop reading its events and
+// commands until it catches up. Events stay queued in its mpv_handle, where
+// the client API drops or coalesces them, so the core is never blocked.
+#define OUTPUT_LIMIT (1024 * 1024)
+
+// All clients are served by a single thread. The thread owns mp_ipc_ctx and
+// everything in it.
 struct mp_ipc_ctx {
     struct mp_log *log;
     struct mp_client_api *client_api;
     const char *path;
 
     pthread_t thread;
+    atomic_bool detached;   // set before death_pipe is written
     int death_pipe[2];
+    int wakeup_pipe[2];     // written by the client wakeup callbacks
+    int listen_fd;
+
+    struct client_arg **clients;
+    int num_clients;
+    int client_num;         // for naming new clients
 };
 
 struct client_arg {
@@ -59,183 +78,245 @@ struct client_arg {
 
     char *client_name;
     int client_fd;
-    bool close_client_fd;
+    bool close_client_fd;   // also: client_fd is our own, and non-blocking
 
     bool writable;
+    enum mp_ipc_protocol protocol;
+
+    int wakeup_fd;
+    atomic_bool events_pending;
+
+    bstr client_msg;        // received data not yet executed
+    bstr output;            // data not yet sent, starting at output_pos
+    size_t output_pos;
 };
 
-static int ipc_write_str(struct client_arg *client, const char *buf)
+static void wakeup_cb(void *d)
+{
+    struct client_arg *arg = d;
+    atomic_store(&arg->events_pending, true);
+    (void)write(arg->wakeup_fd, &(char){0}, 1);
+}
+
+static bool output_full(struct client_arg *arg)
+{
+    return arg->output.len - arg->output_pos >= OUTPUT_LIMIT;
+}
+
+static void queue_output(struct client_arg *arg, bstr data)
+{
+    bstr_xappend(NULL, &arg->output, data);
+}
+
+// Send as much of the queued output as possible without blocking.
+static int flush_output(struct client_arg *arg)
 {
-    size_t count = strlen(buf);
-    while (count > 0) {
-        ssize_t rc = send(client->client_fd, buf, count, MSG_NOSIGNAL);
+    while (arg->output_pos < arg->output.len) {
+        // (MSG_DONTWAIT for inherited fds, which are left blocking.)
+        ssize_t rc = send(arg->client_fd, arg->output.start + arg->output_pos,
+                          arg->output.len - arg->output_pos,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
         if (rc <= 0) {
-            if (rc == 0)
+            if (rc == 0) {
+                MP_ERR(arg, "Write error\n");
                 return -1;
+            }
 
             if (errno == EBADF) {
-                client->writable = false;
-                return 0;
+                arg->writable = false;
+                arg->output_pos = arg->output.len;
+                break;
             }
 
-            if (errno == EINTR || errno == EAGAIN)
+            if (errno == EINTR)
                 continue;
 
-            return rc;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
+            return -1;
         }
 
-        count -= rc;
-        buf   += rc;
+        arg->output_pos += rc;
+    }
+
+    if (arg->output_pos == arg->output.len) {
+        arg->output.len = arg->output_pos = 0;
+    } else if (arg->output_pos >= arg->output.len / 2) {
+        arg->output.len -= arg->output_pos;
+        memmove(arg->output.start, arg->output.start + arg->output_pos,
+                arg->output.len);
+        arg->output_pos = 0;
     }
 
     return 0;
 }
 
-static void *client_thread(void *p)
+static int read_events(struct client_arg *arg)
 {
-    pthread_detach(pthread_self());
-
-    // We don't use MSG_NOSIGNAL because the moldy fruit OS doesn't support it.
-    struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART };
-    sigfillset(&sa.sa_mask);
-    sigaction(SIGPIPE, &sa, NULL);
+    if (!atomic_exchange(&arg->events_pending, false))
+        return 0;
 
-    int rc;
+    while (1) {
+        if (output_full(arg)) {
+            // Continue once the client has read enough.
+            atomic_store(&arg->events_pending, true);
+            return 0;
+        }
 
-    struct client_arg *arg = p;
-    bstr client_msg = { talloc_strdup(NULL, ""), 0 };
+        mpv_event *event = mpv_wait_event(arg->client, 0);
 
-    mpthread_set_name(arg->client_name);
+        if (event->event_id == MPV_EVENT_NONE)
+            return 0;
 
-    int pipe_fd = mpv_get_wakeup_pipe(arg->client);
-    if (pipe_fd < 0) {
-        MP_ERR(arg, "Could not get wakeup pipe\n");
-        goto done;
-    }
+        if (event->event_id == MPV_EVENT_SHUTDOWN)
+            return -1;
 
-    MP_VERBOSE(arg, "Client connected\n");
+        if (!arg->writable)
+            continue;
 
-    struct pollfd fds[2] = {
-        {.events = POLLIN, .fd = pipe_fd},
-        {.events = POLLIN, .fd = arg->client_fd},
-    };
+        bstr event_msg = mp_ipc_encode_event(NULL, event, arg->protocol);
+        if (!event_msg.start) {
+            MP_ERR(arg, "Encoding error\n");
+            return -1;
+        }
 
-    fcntl(arg->client_fd, F_SETFL, fcntl(arg->client_fd, F_GETFL, 0) | O_NONBLOCK);
+        queue_output(arg, event_msg);
+        talloc_free(event_msg.start);
+    }
+}
 
-    while (1) {
-        rc = poll(fds, 2, 0);
-        if (rc == 0)
-            rc = poll(fds, 2, -1);
+// Note that commands are run synchronously, so a slow command delays all
+// other clients as well. The asynchronous client API can't return command
+// results, and the player is blocked while the command runs anyway.
+static int run_commands(struct client_arg *arg)
+{
+    while (!output_full(arg)) {
+        int rc = mp_ipc_has_command(arg->client_msg, arg->protocol);
         if (rc < 0) {
-            MP_ERR(arg, "Poll error\n");
-            continue;
+            MP_ERR(arg, "Invalid message framing\n");
+            return -1;
         }
+        if (rc == 0)
+            break;
 
-        if (fds[0].revents & POLLIN) {
-            mp_flush_wakeup_pipe(pipe_fd);
+        bstr reply_msg = mp_ipc_consume_next_command(arg->client, NULL,
+                            &arg->client_msg, &arg->protocol);
+        if (reply_msg.start && arg->writable)
+            queue_output(arg, reply_msg);
+        talloc_free(reply_msg.start);
+    }
 
-            while (1) {
-                mpv_event *event = mpv_wait_event(arg->client, 0);
+    return 0;
+}
 
-                if (event->event_id == MPV_EVENT_NONE)
-                    break;
+static int read_input(struct client_arg *arg)
+{
+    while (!output_full(arg)) {
+        char buf[4096];
 
-                if (event->event_id == MPV_EVENT_SHUTDOWN)
-                    goto done;
+        ssize_t bytes = read(arg->client_fd, buf, sizeof(buf));
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
 
-                if (!arg->writable)
-                    continue;
+            if (errno == EINTR)
+                continue;
 
-                char *event_msg = mp_json_encode_event(event);
-                if (!event_msg) {
-                    MP_ERR(arg, "Encoding error\n");
-                    goto done;
-                }
+            MP_ERR(arg, "Read error (%s)\n", mp_strerror(errno));
+            return -1;
+        }
 
-                rc = ipc_write_str(arg, event_msg);
-                talloc_free(event_msg);
-                if (rc < 0) {
-                    MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
-                    goto done;
-                }
-            }
+        if (bytes == 0) {
+            MP_VERBOSE(arg, "Client disconnected\n");
+            return -1;
         }
 
-        if (fds[1].revents & (POLLIN | POLLHUP)) {
-            while (1) {
-                char buf[128];
-                bstr append = { buf, 0 };
+        bstr_xappend(NULL, &arg->client_msg, (bstr){buf, bytes});
 
-                ssize_t bytes = read(arg->client_fd, buf, sizeof(buf));
-                if (bytes < 0) {
-                    if (errno == EAGAIN)
-                        break;
+        if (run_commands(arg) < 0)
+            return -1;
 
-                    MP_ERR(arg, "Read error (%s)\n", mp_strerror(errno));
-                    goto done;
-                }
+        // Inherited fds are blocking, so only one read() per POLLIN.
+        if (!arg->close_client_fd)
+            break;
+    }
 
-                if (bytes == 0) {
-                    MP_VERBOSE(arg, "Client disconnected\n");
-                    goto done;
-                }
+    return 0;
+}
 
-                append.len = bytes;
+// Handle the poll() result for this client. Returns -1 if the client should
+// be destroyed.
+static int process_client(struct client_arg *arg, int revents)
+{
+    if ((revents & POLLOUT) && flush_output(arg) < 0)
+        return -1;
 
-                bstr_xappend(NULL, &client_msg, append);
+    // Commands that were left over while the output was full.
+    if (run_commands(arg) < 0)
+        return -1;
 
-                while (bstrchr(client_msg, '\n') != -1) {
-                    char *reply_msg = mp_ipc_consume_next_command(arg->client,
-                        NULL, &client_msg);
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && read_input(arg) < 0)
+        return -1;
 
-                    if (reply_msg && arg->writable) {
-                        rc = ipc_write_str(arg, reply_msg);
-                        if (rc < 0) {
-                            MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
-                            talloc_free(reply_msg);
-                            goto done;
-                        }
-                    }
+    if (read_events(arg) < 0)
+        return -1;
 
-                    talloc_free(reply_msg);
-                }
-            }
-        }
-    }
+    return flush_output(arg);
+}
 
-done:
-    if (client_msg.len > 0)
+static int client_poll_events(struct client_arg *arg)
+{
+    int events = 0;
+    if (!output_full(arg))
+        events |= POLLIN;
+    if (arg->output_pos < arg->output.len)
+        events |= POLLOUT;
+    return events;
+}
+
+static void destroy_client(struct mp_ipc_ctx *ctx, int index)
+{
+    struct client_arg *arg = ctx->clients[index];
+    MP_TARRAY_REMOVE_AT(ctx->clients, ctx->num_clients, index);
+
+    if (arg->client_msg.len > 0)
         MP_WARN(arg, "Ignoring unterminated command on disconnect.\n");
-    talloc_free(client_msg.start);
+    talloc_free(arg->client_msg.start);
+    talloc_free(arg->output.start);
     if (arg->close_client_fd)
         close(arg->client_fd);
+    mpv_set_wakeup_callback(arg->client, NULL, NULL);
     mpv_destroy(arg->client);
     talloc_free(arg);
-    return NULL;
 }
 
 static void ipc_start_client(struct mp_ipc_ctx *ctx, struct client_arg *client)
 {
     client->client = mp_new_client(ctx->client_api, client->client_name);
-    if (!client->client)
-        goto err;
+    if (!client->client) {
+        if (client->close_client_fd)
+            close(client->client_fd);
+        talloc_free(client);
+        return;
+    }
 
     client->log = mp_client_get_log(client->client);
+    client->wakeup_fd = ctx->wakeup_pipe[1];
 
-    pthread_t client_thr;
-    if (pthread_create(&client_thr, NULL, client_thread, client))
-        goto err;
-
-    return;
+    // Don't change inherited fds (like stdin), because O_NONBLOCK is a
+    // property of the open file description shared with other processes.
+    if (client->close_client_fd) {
+        fcntl(client->client_fd, F_SETFL,
+              fcntl(client->client_fd, F_GETFL, 0) | O_NONBLOCK);
+    }
 
-err:
-    if (client->client)
-        mpv_destroy(client->client);
+    MP_TARRAY_APPEND(ctx, ctx->clients, ctx->num_clients, client);
 
-    if (client->close_client_fd)
-        close(client->client_fd);
+    MP_VERBOSE(client, "Client connected\n");
 
-    talloc_free(client);
+    mpv_set_wakeup_callback(client->client, wakeup_cb, client);
 }
 
 static void ipc_start_client_json(struct mp_ipc_ctx *ctx, int id, int fd)
@@ -294,23 +375,19 @@ static void ipc_start_client_text(struct mp_ipc_ctx *ctx, const char *path)
     ipc_start_client(ctx, client);
 }
 
-static void *ipc_thread(void *p)
+static int ipc_listen(struct mp_ipc_ctx *arg)
 {
     int rc;
 
     int ipc_fd;
     struct sockaddr_un ipc_un = {0};
 
-    struct mp_ipc_ctx *arg = p;
-
-    mpthread_set_name("ipc socket listener");
-
     MP_VERBOSE(arg, "Starting IPC master\n");
 
     ipc_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (ipc_fd < 0) {
         MP_ERR(arg, "Could not create IPC socket\n");
-        goto done;
+        goto error;
     }
 
 #if HAVE_FCHMOD
@@ -320,7 +397,7 @@ static void *ipc_thread(void *p)
     size_t path_len = strlen(arg->path);
     if (path_len >= sizeof(ipc_un.sun_path) - 1) {
         MP_ERR(arg, "Could not create IPC socket\n");
-        goto done;
+        goto error;
     }
 
     ipc_un.sun_family = AF_UNIX,
@@ -337,49 +414,130 @@ static void *ipc_thread(void *p)
     rc = bind(ipc_fd, (struct sockaddr *) &ipc_un, addr_len);
     if (rc < 0) {
         MP_ERR(arg, "Could not bind IPC socket\n");
-        goto done;
+        goto error;
     }
 
     rc = listen(ipc_fd, 10);
     if (rc < 0) {
         MP_ERR(arg, "Could not listen on IPC socket\n");
-        goto done;
+        goto error;
     }
 
     MP_VERBOSE(arg, "Listening to IPC socket.\n");
 
-    int client_num = 0;
+    return ipc_fd;
 
-    struct pollfd fds[2] = {
-        {.events = POLLIN, .fd = arg->death_pipe[0]},
-        {.events = POLLIN, .fd = ipc_fd},
-    };
+error:
+    if (ipc_fd >= 0)
+        close(ipc_fd);
+    return -1;
+}
 
-    while (1) {
-        rc = poll(fds, 2, -1);
-        if (rc < 0) {
-            MP_ERR(arg, "Poll error\n");
+static void ipc_destroy(struct mp_ipc_ctx *arg)
+{
+    while (arg->num_clients)
+        destroy_client(arg, arg->num_clients - 1);
+
+    if (arg->listen_fd >= 0)
+        close(arg->listen_fd);
+    for (int n = 0; n < 2; n++) {
+        if (arg->death_pipe[n] >= 0)
+            close(arg->death_pipe[n]);
+        if (arg->wakeup_pipe[n] >= 0)
+            close(arg->wakeup_pipe[n]);
+    }
+    talloc_free(arg);
+}
+
+// Fixed entries at the start of the pollfd array, followed by the clients.
+enum {
+    FD_DEATH,
+    FD_WAKEUP,
+    FD_LISTEN,
+    FD_FIRST_CLIENT,
+};
+
+static void *ipc_thread(void *p)
+{
+    struct mp_ipc_ctx *arg = p;
+
+    mpthread_set_name("ipc");
+
+    // We don't use MSG_NOSIGNAL because the moldy fruit OS doesn't support it.
+    struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART };
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGPIPE, &sa, NULL);
+
+    struct pollfd *fds = NULL;
+    int num_fds = 0;
+    bool dead = false;
+
+    // After mp_uninit_ipc(), keep serving the existing clients until they
+    // disconnect or the player shuts down. This is like a separate thread per
+    // client would behave. On a runtime change of the options, mp_uninit_ipc()
+    // can't wait for this, because it's called on the core thread, which the
+    // clients might be waiting on.
+    while (!dead || arg->num_clients) {
+        num_fds = FD_FIRST_CLIENT + arg->num_clients;
+        MP_TARRAY_GROW(arg, fds, num_fds);
+
+        fds[FD_DEATH] = (struct pollfd){
+            .events = POLLIN,
+            .fd = dead ? -1 : arg->death_pipe[0],
+        };
+        fds[FD_WAKEUP] = (struct pollfd){
+            .events = POLLIN,
+            .fd = arg->wakeup_pipe[0],
+        };
+        fds[FD_LISTEN] = (struct pollfd){
+            .events = POLLIN,
+            .fd = arg->listen_fd,
+        };
+        for (int n = 0; n < arg->num_clients; n++) {
+            fds[FD_FIRST_CLIENT + n] = (struct pollfd){
+                .events = client_poll_events(arg->clients[n]),
+                .fd = arg->clients[n]->client_fd,
+            };
+        }
+
+        if (poll(fds, num_fds, -1) < 0) {
+            if (errno != EINTR)
+                MP_ERR(arg, "Poll error\n");
             continue;
         }
 
-        if (fds[0].revents & POLLIN)
-            goto done;
+        if (fds[FD_DEATH].revents & POLLIN) {
+            dead = true;
+            if (arg->listen_fd >= 0)
+                close(arg->listen_fd);
+            arg->listen_fd = -1;
+        }
+
+        if (fds[FD_WAKEUP].revents & POLLIN)
+            mp_flush_wakeup_pipe(arg->wakeup_pipe[0]);
+
+        // Backwards, so removing a client doesn't skip the next one.
+        for (int n = num_fds - FD_FIRST_CLIENT - 1; n >= 0; n--) {
+            if (process_client(arg->clients[n],
+                               fds[FD_FIRST_CLIENT + n].revents) < 0)
+                destroy_client(arg, n);
+        }
 
-        if (fds[1].revents & POLLIN) {
-            int client_fd = accept(ipc_fd, NULL, NULL);
+        if (arg->listen_fd >= 0 && (fds[FD_LISTEN].revents & POLLIN)) {
+            int client_fd = accept(arg->listen_fd, NULL, NULL);
             if (client_fd < 0) {
                 MP_ERR(arg, "Could not accept IPC client\n");
-                goto done;
+                close(arg->listen_fd);
+                arg->listen_fd = -1;
+                continue;
             }
 
-            ipc_start_client_json(arg, client_num++, client_fd);
+            ipc_start_client_json(arg, arg->client_num++, client_fd);
         }
     }
 
-done:
-    if (ipc_fd >= 0)
-        close(ipc_fd);
-
+    if (atomic_load(&arg->detached))
+        ipc_destroy(arg);
     return NULL;
 }
 
@@ -394,16 +552,22 @@ struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
         .client_api = client_api,
         .path       = mp_get_user_path(arg, global, opts->ipc_path),
         .death_pipe = {-1, -1},
+        .wakeup_pipe = {-1, -1},
+        .listen_fd  = -1,
     };
     char *input_file = mp_get_user_path(arg, global, opts->input_file);
 
+    if (mp_make_wakeup_pipe(arg->death_pipe) < 0 ||
+        mp_make_wakeup_pipe(arg->wakeup_pipe) < 0)
+        goto out;
+
     if (input_file && *input_file)
         ipc_start_client_text(arg, input_file);
 
-    if (!opts->ipc_path || !*opts->ipc_path)
-        goto out;
+    if (opts->ipc_path && *opts->ipc_path)
+        arg->listen_fd = ipc_listen(arg);
 
-    if (mp_make_wakeup_pipe(arg->death_pipe) < 0)
+    if (!arg->num_clients && arg->listen_fd < 0)
         goto out;
 
     if (pthread_create(&arg->thread, NULL, ipc_thread, arg))
@@ -412,23 +576,23 @@ struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
     return arg;
 
 out:
-    if (arg->death_pipe[0] >= 0) {
-        close(arg->death_pipe[0]);
-        close(arg->death_pipe[1]);
-    }
-    talloc_free(arg);
+    ipc_destroy(arg);
     return NULL;
 }
 
-void mp_uninit_ipc(struct mp_ipc_ctx *arg)
+void mp_uninit_ipc(struct mp_ipc_ctx *arg, bool wait)
 {
     if (!arg)
         return;
 
-    (void)write(arg->death_pipe[1], &(char){0}, 1);
-    pthread_join(arg->thread, NULL);
-
-    close(arg->death_pipe[0]);
-    close(arg->death_pipe[1]);
-    talloc_free(arg);
+    if (wait) {
+        (void)write(arg->death_pipe[1], &(char){0}, 1);
+        pthread_join(arg->thread, NULL);
+        ipc_destroy(arg);
+    } else {
+        // The IPC thread frees arg when it's done.
+        pthread_detach(arg->thread);
+        atomic_store(&arg->detached, true);
+        (void)write(arg->death_pipe[1], &(char){0}, 1);
+    }
 }
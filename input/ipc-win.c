@@ -49,6 +49,7 @@ struct client_arg {
     HANDLE client_h;
     bool writable;
     OVERLAPPED write_ol;
+    enum mp_ipc_protocol protocol;
 };
 
 // Get a string SID representing the current user. Must be freed by LocalFree.
@@ -166,11 +167,12 @@ static bool pipe_error_is_fatal(DWORD error)
     return true;
 }
 
-static DWORD ipc_write_str(struct client_arg *arg, const char *buf)
+static DWORD ipc_write(struct client_arg *arg, bstr data)
 {
     DWORD error = 0;
 
-    if ((error = async_write(arg->client_h, buf, strlen(buf), &arg->write_ol)))
+    if ((error = async_write(arg->client_h, data.start, data.len,
+                             &arg->write_ol)))
         goto done;
     if (!GetOverlappedResult(arg->client_h, &arg->write_ol, &(DWORD){0}, TRUE)) {
         error = GetLastError();
@@ -251,14 +253,14 @@ static void *client_thread(void *p)
                 if (!arg->writable)
                     continue;
 
-                char *event_msg = mp_json_encode_event(event);
-                if (!event_msg) {
+                bstr event_msg = mp_ipc_encode_event(NULL, event, arg->protocol);
+                if (!event_msg.start) {
                     MP_ERR(arg, "Encoding error\n");
                     goto done;
                 }
 
-                ipc_write_str(arg, event_msg);
-                talloc_free(event_msg);
+                ipc_write(arg, event_msg);
+                talloc_free(event_msg.start);
             }
 
             break;
@@ -270,12 +272,17 @@ static void *client_thread(void *p)
             }
 
             bstr_xappend(NULL, &client_msg, (bstr){buf, r});
-            while (bstrchr(client_msg, '\n') != -1) {
-                char *reply_msg = mp_ipc_consume_next_command(arg->client,
-                    NULL, &client_msg);
-                if (reply_msg && arg->writable)
-                    ipc_write_str(arg, reply_msg);
-                talloc_free(reply_msg);
+            int has_cmd;
+            while ((has_cmd = mp_ipc_has_command(client_msg, arg->protocol)) > 0) {
+                bstr reply_msg = mp_ipc_consume_next_command(arg->client,
+                    NULL, &client_msg, &arg->protocol);
+                if (reply_msg.start && arg->writable)
+                    ipc_write(arg, reply_msg);
+                talloc_free(reply_msg.start);
+            }
+            if (has_cmd < 0) {
+                MP_ERR(arg, "Invalid message framing\n");
+                goto done;
             }
 
             // Begin the next read operation on the pipe
@@ -487,7 +494,7 @@ out:
     return NULL;
 }
 
-void mp_uninit_ipc(struct mp_ipc_ctx *arg)
+void mp_uninit_ipc(struct mp_ipc_ctx *arg, bool wait)
 {
     if (!arg)
         return;
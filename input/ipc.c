@@ -15,11 +15,14 @@
  * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
+
 #include "config.h"
 
 #include "common/msg.h"
 #include "input/input.h"
 #include "misc/json.h"
+#include "misc/msgpack.h"
 #include "options/m_option.h"
 #include "options/options.h"
 #include "options/path.h"
@@ -177,49 +180,69 @@ static void mpv_event_to_node(void *ta_parent, mpv_event *event, mpv_node *dst)
     }
 }
 
-char *mp_json_encode_event(mpv_event *event)
+// Serialize node in the given protocol, including the message framing.
+// Returns {0} on failure.
+static bstr encode_node(void *ta_parent, mpv_node *node,
+                        enum mp_ipc_protocol protocol)
+{
+    if (protocol == MP_IPC_PROTOCOL_MSGPACK) {
+        // 4 byte big endian length prefix, filled in after writing.
+        bstr output = {0};
+        bstr_xappend(ta_parent, &output, (bstr){(unsigned char[4]){0}, 4});
+        if (msgpack_write(ta_parent, &output, node) < 0 ||
+            output.len - 4 > UINT32_MAX)
+        {
+            talloc_free(output.start);
+            return (bstr){0};
+        }
+        uint32_t len = output.len - 4;
+        for (int n = 0; n < 4; n++)
+            output.start[n] = len >> ((3 - n) * 8);
+        return output;
+    }
+
+    char *output = talloc_strdup(ta_parent, "");
+    json_write(&output, node);
+    output = ta_talloc_strdup_append(output, "\n");
+    return bstr0(output);
+}
+
+bstr mp_ipc_encode_event(void *ta_parent, mpv_event *event,
+                         enum mp_ipc_protocol protocol)
 {
-    void *ta_parent = talloc_new(NULL);
+    void *tmp = talloc_new(NULL);
     mpv_node event_node = {.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
 
-    mpv_event_to_node(ta_parent, event, &event_node);
+    mpv_event_to_node(tmp, event, &event_node);
 
-    char *output = talloc_strdup(NULL, "");
-    json_write(&output, &event_node);
-    output = ta_talloc_strdup_append(output, "\n");
+    bstr output = encode_node(ta_parent, &event_node, protocol);
 
-    talloc_free(ta_parent);
+    talloc_free(tmp);
 
     return output;
 }
 
-// Function is allowed to modify src[n].
-static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
-                                  char *src)
+// Execute the command message msg_node (NULL if it could not be decoded), and
+// return the reply. *protocol is changed if the client requests a different
+// protocol; the reply is still sent using the old one.
+static mpv_node execute_command(struct mpv_handle *client, void *ta_parent,
+                                mpv_node *msg_node,
+                                enum mp_ipc_protocol *protocol)
 {
     int rc;
     const char *cmd = NULL;
-    struct mp_log *log = mp_client_get_log(client);
 
-    mpv_node msg_node;
     mpv_node reply_node = {.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
     mpv_node *reqid_node = NULL;
 
-    rc = json_parse(ta_parent, &msg_node, &src, 50);
-    if (rc < 0) {
-        mp_err(log, "malformed JSON received: '%s'\n", src);
-        rc = MPV_ERROR_INVALID_PARAMETER;
-        goto error;
-    }
-
-    if (msg_node.format != MPV_FORMAT_NODE_MAP) {
+    if (!msg_node || msg_node->format != MPV_FORMAT_NODE_MAP) {
         rc = MPV_ERROR_INVALID_PARAMETER;
         goto error;
     }
 
-    reqid_node = mpv_node_map_get(&msg_node, "request_id");
+    reqid_node = mpv_node_map_get(msg_node, "request_id");
 
-    mpv_node *cmd_node = mpv_node_map_get(&msg_node, "command");
+    mpv_node *cmd_node = mpv_node_map_get(msg_node, "command");
     if (!cmd_node ||
         (cmd_node->format != MPV_FORMAT_NODE_ARRAY) ||
         !cmd_node->u.list->num)
@@ -248,6 +271,27 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         int64_t ver = mpv_client_api_version();
         mpv_node_map_add_int64(ta_parent, &reply_node, "data", ver);
         rc = MPV_ERROR_SUCCESS;
+    } else if (!strcmp("set_protocol", cmd)) {
+        if (cmd_node->u.list->num != 2) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        if (cmd_node->u.list->values[1].format != MPV_FORMAT_STRING) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        char *name = cmd_node->u.list->values[1].u.string;
+        if (!strcmp(name, "json")) {
+            *protocol = MP_IPC_PROTOCOL_JSON;
+        } else if (!strcmp(name, "msgpack")) {
+            *protocol = MP_IPC_PROTOCOL_MSGPACK;
+        } else {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+        rc = MPV_ERROR_SUCCESS;
     } else if (!strcmp("get_property", cmd)) {
         mpv_node result_node;
 
@@ -419,42 +463,106 @@ error:
 
     mpv_node_map_add_string(ta_parent, &reply_node, "error", mpv_error_string(rc));
 
-    char *output = talloc_strdup(ta_parent, "");
-    json_write(&output, &reply_node);
-    output = ta_talloc_strdup_append(output, "\n");
+    return reply_node;
+}
 
-    return output;
+// Function is allowed to modify src[n].
+static bstr json_execute_command(struct mpv_handle *client, void *ta_parent,
+                                 char *src, enum mp_ipc_protocol *protocol)
+{
+    struct mp_log *log = mp_client_get_log(client);
+
+    mpv_node msg_node;
+    mpv_node *msg = &msg_node;
+    if (json_parse(ta_parent, &msg_node, &src, 50) < 0) {
+        mp_err(log, "malformed JSON received: '%s'\n", src);
+        msg = NULL;
+    }
+
+    mpv_node reply_node = execute_command(client, ta_parent, msg, protocol);
+    return encode_node(ta_parent, &reply_node, MP_IPC_PROTOCOL_JSON);
+}
+
+static bstr msgpack_execute_command(struct mpv_handle *client, void *ta_parent,
+                                    bstr src, enum mp_ipc_protocol *protocol)
+{
+    struct mp_log *log = mp_client_get_log(client);
+
+    mpv_node msg_node;
+    mpv_node *msg = &msg_node;
+    if (msgpack_parse(ta_parent, &msg_node, &src, 50) < 0 || src.len) {
+        mp_err(log, "malformed msgpack message received\n");
+        msg = NULL;
+    }
+
+    mpv_node reply_node = execute_command(client, ta_parent, msg, protocol);
+    return encode_node(ta_parent, &reply_node, MP_IPC_PROTOCOL_MSGPACK);
 }
 
-static char *text_execute_command(struct mpv_handle *client, void *tmp, char *src)
+static bstr text_execute_command(struct mpv_handle *client, void *tmp, char *src)
 {
     mpv_command_string(client, src);
 
-    return NULL;
+    return (bstr){0};
 }
 
-char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *buf)
+// Size of the msgpack frame payload; buf must contain at least 4 bytes.
+static uint32_t get_frame_size(bstr buf)
 {
-    void *tmp = talloc_new(NULL);
+    uint32_t len = 0;
+    for (int n = 0; n < 4; n++)
+        len = (len << 8) | buf.start[n];
+    return len;
+}
 
-    bstr rest;
-    bstr line = bstr_getline(*buf, &rest);
-    char *line0 = bstrto0(tmp, line);
-    talloc_steal(tmp, buf->start);
-    *buf = bstrdup(NULL, rest);
+int mp_ipc_has_command(bstr buf, enum mp_ipc_protocol protocol)
+{
+    if (protocol == MP_IPC_PROTOCOL_MSGPACK) {
+        if (buf.len < 4)
+            return 0;
+        uint32_t len = get_frame_size(buf);
+        if (len > MP_IPC_MAX_FRAME_SIZE)
+            return -1;
+        return buf.len - 4 >= len;
+    }
+    return bstrchr(buf, '\n') >= 0;
+}
+
+bstr mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx,
+                                 bstr *buf, enum mp_ipc_protocol *protocol)
+{
+    assert(mp_ipc_has_command(*buf, *protocol) > 0);
 
-    json_skip_whitespace(&line0);
+    void *tmp = talloc_new(NULL);
+    bstr reply_msg = {0};
+
+    if (*protocol == MP_IPC_PROTOCOL_MSGPACK) {
+        size_t len = get_frame_size(*buf);
+        bstr frame = bstr_splice(*buf, 4, 4 + len);
+        bstr rest = bstr_cut(*buf, 4 + len);
+        talloc_steal(tmp, buf->start);
+        *buf = bstrdup(NULL, rest);
 
-    char *reply_msg = NULL;
-    if (line0[0] == '\0' || line0[0] == '#') {
-        // skip
-    } else if (line0[0] == '{') {
-        reply_msg = json_execute_command(client, tmp, line0);
+        reply_msg = msgpack_execute_command(client, tmp, frame, protocol);
     } else {
-        reply_msg = text_execute_command(client, tmp, line0);
+        bstr rest;
+        bstr line = bstr_getline(*buf, &rest);
+        char *line0 = bstrto0(tmp, line);
+        talloc_steal(tmp, buf->start);
+        *buf = bstrdup(NULL, rest);
+
+        json_skip_whitespace(&line0);
+
+        if (line0[0] == '\0' || line0[0] == '#') {
+            // skip
+        } else if (line0[0] == '{') {
+            reply_msg = json_execute_command(client, tmp, line0, protocol);
+        } else {
+            reply_msg = text_execute_command(client, tmp, line0);
+        }
     }
 
-    talloc_steal(ctx, reply_msg);
+    talloc_steal(ctx, reply_msg.start);
     talloc_free(tmp);
     return reply_msg;
 }
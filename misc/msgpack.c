@@ -0,0 +1,356 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MessagePack parser and writer for mpv_node.
+ *
+ * Mapping between msgpack types and mpv_node formats:
+ *
+ *  nil         MPV_FORMAT_NONE
+ *  bool        MPV_FORMAT_FLAG
+ *  int         MPV_FORMAT_INT64 (unsigned values > INT64_MAX are rejected)
+ *  float       MPV_FORMAT_DOUBLE (float 32 is accepted when parsing)
+ *  str         MPV_FORMAT_STRING (strings containing '\0' are rejected)
+ *  bin         MPV_FORMAT_BYTE_ARRAY
+ *  array       MPV_FORMAT_NODE_ARRAY
+ *  map         MPV_FORMAT_NODE_MAP (keys must be strings)
+ *
+ * Extension types are not supported. The writer always uses the smallest
+ * representation of a value.
+ *
+ * Also see: https://github.com/msgpack/msgpack/blob/master/spec.md
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "common/common.h"
+
+#include "msgpack.h"
+
+static bool read_be(bstr *src, int bytes, uint64_t *v)
+{
+    if (src->len < bytes)
+        return false;
+    *v = 0;
+    for (int n = 0; n < bytes; n++)
+        *v = (*v << 8) | src->start[n];
+    *src = bstr_cut(*src, bytes);
+    return true;
+}
+
+static bool read_int(bstr *src, int bytes, int64_t *v)
+{
+    uint64_t u;
+    if (!read_be(src, bytes, &u))
+        return false;
+    if (bytes < 8 && (u & (1ULL << (bytes * 8 - 1))))
+        u |= ~0ULL << (bytes * 8);
+    *v = (int64_t)u;
+    return true;
+}
+
+static int read_str(void *ta_parent, struct mpv_node *dst, bstr *src,
+                    uint64_t len, bool binary)
+{
+    if (src->len < len)
+        return -1; // early EOF
+    bstr data = bstr_splice(*src, 0, len);
+    *src = bstr_cut(*src, len);
+    if (binary) {
+        struct mpv_byte_array *ba = talloc_zero(ta_parent, struct mpv_byte_array);
+        ba->data = talloc_memdup(ba, data.start, data.len);
+        ba->size = data.len;
+        dst->format = MPV_FORMAT_BYTE_ARRAY;
+        dst->u.ba = ba;
+    } else {
+        if (bstrchr(data, '\0') >= 0)
+            return -1; // can't be represented as C string
+        dst->format = MPV_FORMAT_STRING;
+        dst->u.string = bstrto0(ta_parent, data);
+    }
+    return 0;
+}
+
+static int read_sub(void *ta_parent, struct mpv_node *dst, bstr *src,
+                    uint64_t num, bool is_obj, int max_depth)
+{
+    // Each entry takes at least 1 byte; don't allocate for broken lengths.
+    if (num > src->len)
+        return -1;
+    struct mpv_node_list *list = talloc_zero(ta_parent, struct mpv_node_list);
+    list->values = talloc_array(list, struct mpv_node, num);
+    if (is_obj)
+        list->keys = talloc_array(list, char *, num);
+    for (list->num = 0; list->num < num; list->num++) {
+        if (is_obj) {
+            struct mpv_node keynode;
+            if (msgpack_parse(list, &keynode, src, max_depth) < 0 ||
+                keynode.format != MPV_FORMAT_STRING)
+                return -1; // key is not a string
+            list->keys[list->num] = keynode.u.string;
+        }
+        if (msgpack_parse(ta_parent, &list->values[list->num], src,
+                          max_depth) < 0)
+            return -1;
+    }
+    dst->format = is_obj ? MPV_FORMAT_NODE_MAP : MPV_FORMAT_NODE_ARRAY;
+    dst->u.list = list;
+    return 0;
+}
+
+/* Parse a single msgpack object at the start of *src, and write the result
+ * into *dst. max_depth limits the recursion and tree depth.
+ * Returns:
+ *   0: success, *dst is valid, *src is advanced past the parsed object (the
+ *      caller must check whether there is trailing data)
+ *  -1: failure, *dst is invalid, there may be dead allocs under ta_parent
+ *      (ta_free_children(ta_parent) is the only way to free them)
+ * Unlike json_parse(), the input data is not modified, and *dst does not
+ * reference it.
+ */
+int msgpack_parse(void *ta_parent, struct mpv_node *dst, bstr *src,
+                  int max_depth)
+{
+    max_depth -= 1;
+    if (max_depth < 0)
+        return -1;
+
+    if (!src->len)
+        return -1; // early EOF
+
+    unsigned char c = src->start[0];
+    *src = bstr_cut(*src, 1);
+
+    uint64_t len;
+    if (c <= 0x7f) {
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = c;
+        return 0;
+    } else if (c >= 0xe0) {
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = (int8_t)c;
+        return 0;
+    } else if (c <= 0x8f) {
+        return read_sub(ta_parent, dst, src, c & 0x0f, true, max_depth);
+    } else if (c <= 0x9f) {
+        return read_sub(ta_parent, dst, src, c & 0x0f, false, max_depth);
+    } else if (c <= 0xbf) {
+        return read_str(ta_parent, dst, src, c & 0x1f, false);
+    }
+
+    switch (c) {
+    case 0xc0:
+        dst->format = MPV_FORMAT_NONE;
+        return 0;
+    case 0xc2:
+    case 0xc3:
+        dst->format = MPV_FORMAT_FLAG;
+        dst->u.flag = c == 0xc3;
+        return 0;
+    case 0xc4:
+    case 0xc5:
+    case 0xc6:
+        if (!read_be(src, 1 << (c - 0xc4), &len))
+            return -1;
+        return read_str(ta_parent, dst, src, len, true);
+    case 0xca: {
+        uint64_t v;
+        float f;
+        if (!read_be(src, 4, &v))
+            return -1;
+        uint32_t v32 = v;
+        memcpy(&f, &v32, sizeof(f));
+        dst->format = MPV_FORMAT_DOUBLE;
+        dst->u.double_ = f;
+        return 0;
+    }
+    case 0xcb: {
+        uint64_t v;
+        if (!read_be(src, 8, &v))
+            return -1;
+        dst->format = MPV_FORMAT_DOUBLE;
+        memcpy(&dst->u.double_, &v, sizeof(v));
+        return 0;
+    }
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf: {
+        uint64_t v;
+        if (!read_be(src, 1 << (c - 0xcc), &v) || v > INT64_MAX)
+            return -1;
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = v;
+        return 0;
+    }
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+        if (!read_int(src, 1 << (c - 0xd0), &dst->u.int64))
+            return -1;
+        dst->format = MPV_FORMAT_INT64;
+        return 0;
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+        if (!read_be(src, 1 << (c - 0xd9), &len))
+            return -1;
+        return read_str(ta_parent, dst, src, len, false);
+    case 0xdc:
+    case 0xdd:
+        if (!read_be(src, c == 0xdc ? 2 : 4, &len))
+            return -1;
+        return read_sub(ta_parent, dst, src, len, false, max_depth);
+    case 0xde:
+    case 0xdf:
+        if (!read_be(src, c == 0xde ? 2 : 4, &len))
+            return -1;
+        return read_sub(ta_parent, dst, src, len, true, max_depth);
+    }
+    return -1; // reserved byte or unsupported extension type
+}
+
+// Append the tag byte c, followed by the lowest "bytes" bytes of v in big
+// endian.
+static void write_tag(void *ta_parent, bstr *b, unsigned char c, uint64_t v,
+                      int bytes)
+{
+    unsigned char buf[9] = {c};
+    for (int n = 0; n < bytes; n++)
+        buf[1 + n] = v >> ((bytes - 1 - n) * 8);
+    bstr_xappend(ta_parent, b, (bstr){buf, 1 + bytes});
+}
+
+static void write_int(void *ta_parent, bstr *b, int64_t v)
+{
+    if (v >= 0) {
+        if (v <= 0x7f) {
+            write_tag(ta_parent, b, v, 0, 0);
+        } else if (v <= UINT8_MAX) {
+            write_tag(ta_parent, b, 0xcc, v, 1);
+        } else if (v <= UINT16_MAX) {
+            write_tag(ta_parent, b, 0xcd, v, 2);
+        } else if (v <= UINT32_MAX) {
+            write_tag(ta_parent, b, 0xce, v, 4);
+        } else {
+            write_tag(ta_parent, b, 0xcf, v, 8);
+        }
+    } else {
+        if (v >= -32) {
+            write_tag(ta_parent, b, (uint8_t)v, 0, 0);
+        } else if (v >= INT8_MIN) {
+            write_tag(ta_parent, b, 0xd0, v, 1);
+        } else if (v >= INT16_MIN) {
+            write_tag(ta_parent, b, 0xd1, v, 2);
+        } else if (v >= INT32_MIN) {
+            write_tag(ta_parent, b, 0xd2, v, 4);
+        } else {
+            write_tag(ta_parent, b, 0xd3, v, 8);
+        }
+    }
+}
+
+// Write the header of a str/bin/array/map. fix_max is the largest length
+// that fits into the "fix" variant (fix_tag | len), or -1 if there is none.
+// tags[] are the variants with 8, 16 and 32 bit lengths (0 if not available).
+static int write_len(void *ta_parent, bstr *b, size_t len,
+                     unsigned char fix_tag, int fix_max,
+                     const unsigned char tags[3])
+{
+    if (fix_max >= 0 && len <= (size_t)fix_max) {
+        write_tag(ta_parent, b, fix_tag | len, 0, 0);
+    } else if (tags[0] && len <= UINT8_MAX) {
+        write_tag(ta_parent, b, tags[0], len, 1);
+    } else if (len <= UINT16_MAX) {
+        write_tag(ta_parent, b, tags[1], len, 2);
+    } else if (len <= UINT32_MAX) {
+        write_tag(ta_parent, b, tags[2], len, 4);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int write_str(void *ta_parent, bstr *b, bstr str, bool binary)
+{
+    int r = binary
+        ? write_len(ta_parent, b, str.len, 0, -1,
+                    (const unsigned char[]){0xc4, 0xc5, 0xc6}) // no fixbin
+        : write_len(ta_parent, b, str.len, 0xa0, 31,
+                    (const unsigned char[]){0xd9, 0xda, 0xdb});
+    if (r < 0)
+        return r;
+    bstr_xappend(ta_parent, b, str);
+    return 0;
+}
+
+static int msgpack_append(void *ta_parent, bstr *b, const struct mpv_node *src)
+{
+    switch (src->format) {
+    case MPV_FORMAT_NONE:
+        write_tag(ta_parent, b, 0xc0, 0, 0);
+        return 0;
+    case MPV_FORMAT_FLAG:
+        write_tag(ta_parent, b, src->u.flag ? 0xc3 : 0xc2, 0, 0);
+        return 0;
+    case MPV_FORMAT_INT64:
+        write_int(ta_parent, b, src->u.int64);
+        return 0;
+    case MPV_FORMAT_DOUBLE: {
+        uint64_t v;
+        memcpy(&v, &src->u.double_, sizeof(v));
+        write_tag(ta_parent, b, 0xcb, v, 8);
+        return 0;
+    }
+    case MPV_FORMAT_STRING:
+        return write_str(ta_parent, b, bstr0(src->u.string), false);
+    case MPV_FORMAT_BYTE_ARRAY:
+        return write_str(ta_parent, b,
+                         (bstr){src->u.ba->data, src->u.ba->size}, true);
+    case MPV_FORMAT_NODE_ARRAY:
+    case MPV_FORMAT_NODE_MAP: {
+        struct mpv_node_list *list = src->u.list;
+        bool is_obj = src->format == MPV_FORMAT_NODE_MAP;
+        int r = is_obj
+            ? write_len(ta_parent, b, list->num, 0x80, 15,
+                        (const unsigned char[]){0, 0xde, 0xdf})
+            : write_len(ta_parent, b, list->num, 0x90, 15,
+                        (const unsigned char[]){0, 0xdc, 0xdd});
+        if (r < 0)
+            return r;
+        for (int n = 0; n < list->num; n++) {
+            if (is_obj && write_str(ta_parent, b, bstr0(list->keys[n]), false) < 0)
+                return -1;
+            if (msgpack_append(ta_parent, b, &list->values[n]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    }
+    return -1; // unknown format
+}
+
+/* Write the contents of *src as msgpack, and append it to *dst. If dst->start
+ * is NULL, a new buffer is allocated under ta_parent, otherwise the existing
+ * allocation is extended (as with bstr_xappend()).
+ * Returns: 0 on success, <0 on failure (dst may contain partial data).
+ */
+int msgpack_write(void *ta_parent, bstr *dst, struct mpv_node *src)
+{
+    return msgpack_append(ta_parent, dst, src);
+}
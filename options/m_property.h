@@ -138,6 +138,16 @@ struct m_property {
 struct m_property *m_property_list_find(const struct m_property *list,
                                         const char *name);
 
+// Return the part of the property name that selects the property itself. For
+// sub-property paths like "a/b" this is "a", otherwise the full name.
+bstr m_property_lookup_name(const char *name);
+
+// Return the property that property_name refers to (see
+// m_property_lookup_name()), or NULL if there is none. This allows callers
+// with large property lists to use a faster lookup than m_property_do().
+typedef struct m_property *(*m_property_find_fn)(void *ctx,
+                                                 const char *property_name);
+
 // Access a property.
 // action: one of m_property_action
 // ctx: opaque value passed through to property implementation
@@ -145,6 +155,13 @@ struct m_property *m_property_list_find(const struct m_property *list,
 int m_property_do(struct mp_log *log, const struct m_property* prop_list,
                   const char* property_name, int action, void* arg, void *ctx);
 
+// Like m_property_do(), but with the property already looked up by the caller.
+// property_name is still the full name, including any sub-property path.
+// prop can be NULL, which returns M_PROPERTY_UNKNOWN.
+int m_property_do_prop(struct mp_log *log, struct m_property *prop,
+                       const char *property_name, int action, void *arg,
+                       void *ctx);
+
 // Given a path of the form "a/b/c", this function will set *prefix to "a",
 // and rem to "b/c", and return true.
 // If there is no '/' in the path, set prefix to path, and rem to "", and
@@ -167,7 +184,8 @@ void m_properties_print_help_list(struct mp_log *log,
 // STR is recursively expanded using the same rules.
 // "$$" can be used to escape "$", and "$}" to escape "}".
 // "$>" disables parsing of "$" for the rest of the string.
-char* m_properties_expand_string(const struct m_property *prop_list,
+// find is used to look up properties, and gets ctx as first argument.
+char* m_properties_expand_string(m_property_find_fn find,
                                  const char *str, void *ctx);
 
 // Trivial helpers for implementing properties.
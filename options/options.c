@@ -60,12 +60,14 @@ extern const struct m_sub_options stream_cdda_conf;
 extern const struct m_sub_options stream_dvb_conf;
 extern const struct m_sub_options stream_lavf_conf;
 extern const struct m_sub_options stream_cache_conf;
+extern const struct m_sub_options stream_file_conf;
 extern const struct m_sub_options sws_conf;
 extern const struct m_sub_options drm_conf;
 extern const struct m_sub_options demux_rawaudio_conf;
 extern const struct m_sub_options demux_rawvideo_conf;
 extern const struct m_sub_options demux_lavf_conf;
 extern const struct m_sub_options demux_mkv_conf;
+extern const struct m_sub_options demux_timeline_conf;
 extern const struct m_sub_options vd_lavc_conf;
 extern const struct m_sub_options ad_lavc_conf;
 extern const struct m_sub_options input_config;
@@ -462,6 +464,8 @@ const m_option_t mp_opts[] = {
     OPT_STRING("sub-demuxer", sub_demuxer_name, 0),
     OPT_FLAG("demuxer-thread", demuxer_thread, 0),
     OPT_FLAG("prefetch-playlist", prefetch_open, 0),
+    OPT_DOUBLE("prefetch-playlist-secs", prefetch_secs, M_OPT_MIN, .min = 0),
+    OPT_BYTE_SIZE("prefetch-playlist-bytes", prefetch_bytes, 0, 0, INT_MAX),
     OPT_FLAG("cache-pause", cache_pause, 0),
     OPT_FLAG("cache-pause-initial", cache_pause_initial, 0),
     OPT_FLOAT("cache-pause-wait", cache_pause_wait, M_OPT_MIN, .min = 0),
@@ -475,6 +479,7 @@ const m_option_t mp_opts[] = {
     OPT_SUBSTRUCT("dvbin", stream_dvb_opts, stream_dvb_conf, 0),
 #endif
     OPT_SUBSTRUCT("", stream_lavf_opts, stream_lavf_conf, 0),
+    OPT_SUBSTRUCT("", stream_file_opts, stream_file_conf, 0),
 
 // ------------------------- a-v sync options --------------------
 
@@ -527,6 +532,7 @@ const m_option_t mp_opts[] = {
     OPT_SUBSTRUCT("demuxer-rawaudio", demux_rawaudio, demux_rawaudio_conf, 0),
     OPT_SUBSTRUCT("demuxer-rawvideo", demux_rawvideo, demux_rawvideo_conf, 0),
     OPT_SUBSTRUCT("demuxer-mkv", demux_mkv, demux_mkv_conf, 0),
+    OPT_SUBSTRUCT("demuxer-timeline", demux_timeline, demux_timeline_conf, 0),
 
 // ------------------------- subtitles options --------------------
 
@@ -915,6 +921,8 @@ const struct MPOpts mp_default_opts = {
     .position_resume = 1,
     .autoload_files = 1,
     .demuxer_thread = 1,
+    .prefetch_secs = 10.0,
+    .prefetch_bytes = 32 * 1024 * 1024,
     .hls_bitrate = INT_MAX,
     .cache_pause = 1,
     .cache_pause_wait = 1.0,
@@ -67,6 +67,9 @@ struct mp_cache_opts {
     int back_buffer;
     char *file;
     int file_max;
+    int connections;
+    double adaptive_secs;
+    int adaptive_min;
 };
 
 // Subtitle options needed by the subtitle decoders/renderers.
@@ -262,6 +265,8 @@ typedef struct MPOpts {
     char *demuxer_name;
     int demuxer_thread;
     int prefetch_open;
+    double prefetch_secs;
+    int64_t prefetch_bytes;
     char *audio_demuxer_name;
     char *sub_demuxer_name;
 
@@ -306,6 +311,7 @@ typedef struct MPOpts {
     struct cdda_params *stream_cdda_opts;
     struct dvb_params *stream_dvb_opts;
     struct stream_lavf_params *stream_lavf_opts;
+    struct stream_file_opts *stream_file_opts;
 
     char *cdrom_device;
     char *bluray_device;
@@ -317,6 +323,7 @@ typedef struct MPOpts {
     struct demux_rawvideo_opts *demux_rawvideo;
     struct demux_lavf_opts *demux_lavf;
     struct demux_mkv_opts *demux_mkv;
+    struct demux_timeline_opts *demux_timeline;
 
     struct demux_opts *demux_opts;
 
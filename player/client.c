@@ -37,6 +37,7 @@
 #include "options/m_property.h"
 #include "options/path.h"
 #include "options/parse_configfile.h"
+#include "osdep/atomic.h"
 #include "osdep/threads.h"
 #include "osdep/timer.h"
 #include "osdep/io.h"
@@ -77,11 +78,49 @@ struct mp_client_api {
 
     struct mpv_render_context *render_context;
     struct mpv_opengl_cb_context *gl_cb_ctx;
+
+    // Reverse index for property change notifications: observers[id] lists
+    // the observed properties of all clients with observe_property.id==id.
+    // If both are needed, observers_lock must be locked before
+    // mpv_handle.lock. It is independent from the lock above.
+    pthread_mutex_t observers_lock;
+    struct prop_observers **observers;
+    int num_observers;      // (max. id + 1)
+    uint64_t snapshot_seq;  // last prop_snapshot.seq (protected by the same)
+};
+
+// A retrieved property value, shared read-only by all observers of the same
+// property name and format. Refcounted, because observers can keep it after
+// the cache replaced it with a newer value.
+struct prop_snapshot {
+    atomic_int refcount;
+    char *name;
+    mpv_format format;
+    int64_t gen;            // prop_observers.gen when retrieved
+    uint64_t seq;           // unique ID (never 0)
+    uint64_t prev_seq;      // seq of the snapshot this replaced in the cache
+    bool same_as_prev;      // value equals the value of prev_seq
+    bool valid;             // value could be retrieved
+    union m_option_value value;
+};
+
+struct prop_observers {
+    struct observe_property **props;
+    int num_props;
+    // Latest value for each name/format pair observed with this ID.
+    struct prop_snapshot **snapshots;
+    int num_snapshots;
+    // Incremented on every change notification for this ID. Cached values
+    // retrieved before the last increment are not reused. This struct is
+    // never moved or freed, so it can be accessed without observers_lock.
+    mp_atomic_int64 gen;
 };
 
 struct observe_property {
     char *name;
     int id;                 // ==mp_get_property_id(name)
+    int index;              // position in client->properties
+    struct prop_observers *observers; // ==clients->observers[id], or NULL
     uint64_t event_mask;    // ==mp_get_property_event_mask(name)
     int64_t reply_id;
     mpv_format format;
@@ -89,8 +128,10 @@ struct observe_property {
     bool need_new_value;    // a new value should be retrieved
     bool updating;          // a new value is being retrieved
     bool dead;              // property unobserved while retrieving value
-    bool new_value_valid, user_value_valid;
-    union m_option_value new_value, user_value;
+    struct prop_snapshot *new_value; // latest retrieved value, or NULL
+    bool user_value_valid;
+    union m_option_value user_value;
+    uint64_t user_seq;      // prop_snapshot.seq user_value was copied from
     struct mpv_handle *client;
 };
 
@@ -143,6 +184,7 @@ struct mpv_handle {
 static bool gen_log_message_event(struct mpv_handle *ctx);
 static bool gen_property_change_event(struct mpv_handle *ctx);
 static void notify_property_events(struct mpv_handle *ctx, uint64_t event_mask);
+static const struct m_option *get_mp_type_get(mpv_format format);
 
 void mp_clients_init(struct MPContext *mpctx)
 {
@@ -152,6 +194,7 @@ void mp_clients_init(struct MPContext *mpctx)
     };
     mpctx->global->client_api = mpctx->clients;
     pthread_mutex_init(&mpctx->clients->lock, NULL);
+    pthread_mutex_init(&mpctx->clients->observers_lock, NULL);
 }
 
 void mp_clients_destroy(struct MPContext *mpctx)
@@ -170,6 +213,7 @@ void mp_clients_destroy(struct MPContext *mpctx)
     }
 
     pthread_mutex_destroy(&mpctx->clients->lock);
+    pthread_mutex_destroy(&mpctx->clients->observers_lock);
     talloc_free(mpctx->clients);
     mpctx->clients = NULL;
 }
@@ -370,6 +414,83 @@ void mpv_wait_async_requests(mpv_handle *ctx)
     pthread_mutex_unlock(&ctx->lock);
 }
 
+static void prop_snapshot_destroy(void *p)
+{
+    struct prop_snapshot *snap = p;
+    const struct m_option *type = get_mp_type_get(snap->format);
+    if (type)
+        m_option_free(type, &snap->value);
+}
+
+static struct prop_snapshot *prop_snapshot_ref(struct prop_snapshot *snap)
+{
+    if (snap)
+        atomic_fetch_add(&snap->refcount, 1);
+    return snap;
+}
+
+static void prop_snapshot_unref(struct prop_snapshot *snap)
+{
+    if (snap && atomic_fetch_add(&snap->refcount, -1) == 1)
+        talloc_free(snap);
+}
+
+static bool is_same_prop(struct observe_property *prop,
+                         struct prop_snapshot *snap)
+{
+    return prop->format == snap->format && strcmp(prop->name, snap->name) == 0;
+}
+
+// Called with clients->observers_lock held.
+static void add_observer(struct mp_client_api *clients,
+                         struct observe_property *prop)
+{
+    if (prop->id < 0)
+        return; // unknown properties never change
+    if (prop->id >= clients->num_observers) {
+        int num = prop->id + 1;
+        clients->observers = talloc_realloc(clients, clients->observers,
+                                            struct prop_observers *, num);
+        for (int n = clients->num_observers; n < num; n++)
+            clients->observers[n] = talloc_zero(clients, struct prop_observers);
+        clients->num_observers = num;
+    }
+    struct prop_observers *obs = clients->observers[prop->id];
+    MP_TARRAY_APPEND(clients, obs->props, obs->num_props, prop);
+    prop->observers = obs;
+}
+
+// Called with clients->observers_lock held.
+static void remove_observer(struct mp_client_api *clients,
+                            struct observe_property *prop)
+{
+    if (prop->id < 0)
+        return;
+    struct prop_observers *obs = clients->observers[prop->id];
+    bool found = false;
+    for (int n = 0; n < obs->num_props; n++) {
+        if (obs->props[n] == prop) {
+            MP_TARRAY_REMOVE_AT(obs->props, obs->num_props, n);
+            found = true;
+            break;
+        }
+    }
+    assert(found);
+    // Drop the cached value if nothing uses it anymore.
+    for (int n = 0; n < obs->num_props; n++) {
+        if (obs->props[n]->format == prop->format &&
+            strcmp(obs->props[n]->name, prop->name) == 0)
+            return;
+    }
+    for (int n = 0; n < obs->num_snapshots; n++) {
+        if (is_same_prop(prop, obs->snapshots[n])) {
+            prop_snapshot_unref(obs->snapshots[n]);
+            MP_TARRAY_REMOVE_AT(obs->snapshots, obs->num_snapshots, n);
+            break;
+        }
+    }
+}
+
 static void get_thread(void *ptr)
 {
     *(pthread_t *)ptr = pthread_self();
@@ -393,6 +514,13 @@ static void mp_destroy_client(mpv_handle *ctx, bool terminate)
     // causes a crash, block until all asynchronous requests were served.
     mpv_wait_async_requests(ctx);
 
+    pthread_mutex_lock(&clients->observers_lock);
+    pthread_mutex_lock(&ctx->lock);
+    for (int n = 0; n < ctx->num_properties; n++)
+        remove_observer(clients, ctx->properties[n]);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_unlock(&clients->observers_lock);
+
     osd_set_external(mpctx->osd, ctx, 0, 0, NULL);
     mp_input_remove_sections_by_owner(mpctx->input, ctx->name);
 
@@ -1373,10 +1501,9 @@ static void property_free(void *p)
 {
     struct observe_property *prop = p;
     const struct m_option *type = get_mp_type_get(prop->format);
-    if (type) {
-        m_option_free(type, &prop->new_value);
+    if (type)
         m_option_free(type, &prop->user_value);
-    }
+    prop_snapshot_unref(prop->new_value);
 }
 
 int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
@@ -1388,6 +1515,7 @@ int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
     if (format == MPV_FORMAT_OSD_STRING)
         return MPV_ERROR_PROPERTY_FORMAT;
 
+    pthread_mutex_lock(&ctx->clients->observers_lock);
     pthread_mutex_lock(&ctx->lock);
     struct observe_property *prop = talloc_ptrtype(ctx, prop);
     talloc_set_destructor(prop, property_free);
@@ -1395,6 +1523,7 @@ int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
         .client = ctx,
         .name = talloc_strdup(prop, name),
         .id = mp_get_property_id(ctx->mpctx, name),
+        .index = ctx->num_properties,
         .event_mask = mp_get_property_event_mask(name),
         .reply_id = userdata,
         .format = format,
@@ -1402,15 +1531,21 @@ int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
         .need_new_value = true,
     };
     MP_TARRAY_APPEND(ctx, ctx->properties, ctx->num_properties, prop);
+    add_observer(ctx->clients, prop);
+    // Make sure the new observer starts with a fresh value.
+    if (prop->observers)
+        atomic_fetch_add(&prop->observers->gen, 1);
     ctx->property_event_masks |= prop->event_mask;
     ctx->lowest_changed = 0;
     pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_unlock(&ctx->clients->observers_lock);
     invalidate_global_event_mask(ctx);
     return 0;
 }
 
 int mpv_unobserve_property(mpv_handle *ctx, uint64_t userdata)
 {
+    pthread_mutex_lock(&ctx->clients->observers_lock);
     pthread_mutex_lock(&ctx->lock);
     ctx->property_event_masks = 0;
     int count = 0;
@@ -1426,47 +1561,57 @@ int mpv_unobserve_property(mpv_handle *ctx, uint64_t userdata)
                 // with the value update mechanism.
                 talloc_steal(ctx->cur_event, prop);
             }
+            remove_observer(ctx->clients, prop);
             MP_TARRAY_REMOVE_AT(ctx->properties, ctx->num_properties, n);
             count++;
         }
         if (!prop->dead)
             ctx->property_event_masks |= prop->event_mask;
     }
+    for (int n = 0; n < ctx->num_properties; n++)
+        ctx->properties[n]->index = n;
     ctx->lowest_changed = 0;
     pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_unlock(&ctx->clients->observers_lock);
     invalidate_global_event_mask(ctx);
     return count;
 }
 
-static void mark_property_changed(struct mpv_handle *client, int index)
+// Called with prop->client->lock held.
+static void mark_property_changed(struct observe_property *prop)
 {
-    struct observe_property *prop = client->properties[index];
+    struct mpv_handle *client = prop->client;
     prop->changed = true;
     prop->need_new_value = prop->format != 0;
-    client->lowest_changed = MPMIN(client->lowest_changed, index);
+    if (prop->observers)
+        atomic_fetch_add(&prop->observers->gen, 1);
+    client->lowest_changed = MPMIN(client->lowest_changed, prop->index);
 }
 
-// Broadcast that a property has changed.
+// Broadcast that a property has changed. This only touches the clients that
+// observe the property.
 void mp_client_property_change(struct MPContext *mpctx, const char *name)
 {
     struct mp_client_api *clients = mpctx->clients;
     int id = mp_get_property_id(mpctx, name);
+    if (id < 0)
+        return;
 
-    pthread_mutex_lock(&clients->lock);
+    pthread_mutex_lock(&clients->observers_lock);
 
-    for (int n = 0; n < clients->num_clients; n++) {
-        struct mpv_handle *client = clients->clients[n];
-        pthread_mutex_lock(&client->lock);
-        for (int i = 0; i < client->num_properties; i++) {
-            if (client->properties[i]->id == id)
-                mark_property_changed(client, i);
-        }
-        if (client->lowest_changed < client->num_properties)
+    if (id < clients->num_observers) {
+        struct prop_observers *obs = clients->observers[id];
+        for (int n = 0; n < obs->num_props; n++) {
+            struct observe_property *prop = obs->props[n];
+            struct mpv_handle *client = prop->client;
+            pthread_mutex_lock(&client->lock);
+            mark_property_changed(prop);
             wakeup_client(client);
-        pthread_mutex_unlock(&client->lock);
+            pthread_mutex_unlock(&client->lock);
+        }
     }
 
-    pthread_mutex_unlock(&clients->lock);
+    pthread_mutex_unlock(&clients->observers_lock);
 }
 
 // Mark properties as changed in reaction to specific events.
@@ -1475,40 +1620,113 @@ static void notify_property_events(struct mpv_handle *ctx, uint64_t event_mask)
 {
     for (int i = 0; i < ctx->num_properties; i++) {
         if (ctx->properties[i]->event_mask & event_mask)
-            mark_property_changed(ctx, i);
+            mark_property_changed(ctx->properties[i]);
     }
     if (ctx->lowest_changed < ctx->num_properties)
         wakeup_client(ctx);
 }
 
-static void update_prop(void *p)
+// Return the cached value of the property if it was retrieved after the last
+// change notification, or otherwise retrieve it and put it into the cache.
+// Returns a new reference. Must be called on the core thread.
+static struct prop_snapshot *get_prop_snapshot(struct mp_client_api *clients,
+                                               struct observe_property *prop)
 {
-    struct observe_property *prop = p;
-    struct mpv_handle *ctx = prop->client;
-
-    const struct m_option *type = get_mp_type_get(prop->format);
-    union m_option_value val = {0};
+    struct prop_observers *obs = prop->observers;
+    int64_t gen = obs ? atomic_load(&obs->gen) : 0;
+    struct prop_snapshot *prev = NULL;
 
+    pthread_mutex_lock(&clients->observers_lock);
+    for (int n = 0; obs && n < obs->num_snapshots; n++) {
+        if (is_same_prop(prop, obs->snapshots[n])) {
+            prev = prop_snapshot_ref(obs->snapshots[n]);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients->observers_lock);
+
+    if (prev && prev->gen == gen)
+        return prev;
+
+    // Retrieve the value without the lock, as this can trigger property
+    // change notifications.
+    struct prop_snapshot *snap = talloc_ptrtype(NULL, snap);
+    talloc_set_destructor(snap, prop_snapshot_destroy);
+    *snap = (struct prop_snapshot){
+        .refcount = ATOMIC_VAR_INIT(1),
+        .name = talloc_strdup(snap, prop->name),
+        .format = prop->format,
+        .gen = gen,
+    };
     struct getproperty_request req = {
-        .mpctx = ctx->mpctx,
+        .mpctx = clients->mpctx,
         .name = prop->name,
         .format = prop->format,
-        .data = &val,
+        .data = &snap->value,
     };
-
     getproperty_fn(&req);
+    snap->valid = req.status >= 0;
+
+    if (prev) {
+        snap->prev_seq = prev->seq;
+        snap->same_as_prev = prev->valid == snap->valid &&
+            (!snap->valid ||
+             compare_value(&prev->value, &snap->value, snap->format));
+    }
+
+    pthread_mutex_lock(&clients->observers_lock);
+    snap->seq = ++clients->snapshot_seq;
+    // Only cache it if there are still observers (see remove_observer()).
+    bool used = false;
+    for (int n = 0; obs && n < obs->num_props; n++)
+        used |= is_same_prop(obs->props[n], snap);
+    if (used) {
+        bool found = false;
+        for (int n = 0; n < obs->num_snapshots; n++) {
+            if (is_same_prop(prop, obs->snapshots[n])) {
+                prop_snapshot_unref(obs->snapshots[n]);
+                obs->snapshots[n] = prop_snapshot_ref(snap);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            MP_TARRAY_APPEND(clients, obs->snapshots, obs->num_snapshots,
+                             prop_snapshot_ref(snap));
+        }
+    }
+    pthread_mutex_unlock(&clients->observers_lock);
+
+    prop_snapshot_unref(prev);
+    return snap;
+}
+
+static void update_prop(void *p)
+{
+    struct observe_property *prop = p;
+    struct mpv_handle *ctx = prop->client;
+
+    struct prop_snapshot *snap = get_prop_snapshot(ctx->clients, prop);
 
     pthread_mutex_lock(&ctx->lock);
     ctx->properties_updating--;
     prop->updating = false;
-    m_option_free(type, &prop->new_value);
-    prop->new_value_valid = req.status >= 0;
-    if (prop->new_value_valid)
-        memcpy(&prop->new_value, &val, type->type->size);
-    if (prop->user_value_valid != prop->new_value_valid) {
+    prop_snapshot_unref(prop->new_value);
+    prop->new_value = snap;
+    if (prop->user_value_valid != snap->valid) {
         prop->changed = true;
-    } else if (prop->user_value_valid && prop->new_value_valid) {
-        if (!compare_value(&prop->user_value, &prop->new_value, prop->format))
+    } else if (prop->user_value_valid && snap->valid) {
+        // Avoid comparing the full value if the comparison was already done
+        // against the value the user has.
+        bool same;
+        if (prop->user_seq == snap->seq) {
+            same = true;
+        } else if (prop->user_seq == snap->prev_seq) {
+            same = snap->same_as_prev;
+        } else {
+            same = compare_value(&prop->user_value, &snap->value, prop->format);
+        }
+        if (!same)
             prop->changed = true;
     }
     if (prop->dead)
@@ -1539,9 +1757,11 @@ static bool gen_property_change_event(struct mpv_handle *ctx)
                 mp_dispatch_enqueue(ctx->mpctx->dispatch, update_prop, prop);
             } else {
                 const struct m_option *type = get_mp_type_get(prop->format);
-                prop->user_value_valid = prop->new_value_valid;
-                if (prop->new_value_valid)
-                    m_option_copy(type, &prop->user_value, &prop->new_value);
+                struct prop_snapshot *snap = prop->new_value;
+                prop->user_value_valid = snap && snap->valid;
+                prop->user_seq = snap ? snap->seq : 0;
+                if (prop->user_value_valid)
+                    m_option_copy(type, &prop->user_value, &snap->value);
                 ctx->cur_property_event = (struct mpv_event_property){
                     .name = prop->name,
                     .format = prop->user_value_valid ? prop->format : 0,
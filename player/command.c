@@ -74,6 +74,9 @@
 struct command_ctx {
     // All properties, terminated with a {0} item.
     struct m_property *properties;
+    // Pointers into properties[], sorted by name (for binary search).
+    struct m_property **prop_index;
+    int num_properties;
 
     bool is_idle;
 
@@ -134,6 +137,7 @@ static int set_filters(struct MPContext *mpctx, enum stream_type mediatype,
 
 static int mp_property_do_silent(const char *name, int action, void *val,
                                  struct MPContext *ctx);
+static struct m_property *find_property(struct command_ctx *ctx, bstr name);
 
 static void hook_remove(struct MPContext *mpctx, struct hook_handler *h)
 {
@@ -378,7 +382,7 @@ int mp_on_set_option(void *ctx, struct m_config_option *co, void *data, int flag
     // property implementation is trivial, and can break some obscure features
     // like --profile and --include if non-trivial flags are involved (which
     // the bridge would drop).
-    struct m_property *prop = m_property_list_find(cmd->properties, name);
+    struct m_property *prop = find_property(cmd, bstr0(name));
     if (prop && prop->is_option)
         goto direct_option;
 
@@ -1778,6 +1782,107 @@ static int mp_property_demuxer_cache_state(void *ctx, struct m_property *prop,
     node_map_add_int64(r, "debug-low-level-seeks", s.low_level_seeks);
     if (s.ts_last != MP_NOPTS_VALUE)
         node_map_add_double(r, "debug-ts-last", s.ts_last);
+    node_map_add_double(r, "debug-cache-lock-time", s.maint_lock_time);
+    node_map_add_double(r, "debug-cache-lock-max", s.maint_lock_max);
+    node_map_add_int64(r, "debug-lock-count", s.lock_count);
+    node_map_add_int64(r, "debug-lock-contended", s.lock_contended);
+    node_map_add_int64(r, "debug-handoff-reads", s.handoff_reads);
+
+    return M_PROPERTY_OK;
+}
+
+static int mp_property_demuxer_cache_stats(void *ctx, struct m_property *prop,
+                                           int action, void *arg)
+{
+    MPContext *mpctx = ctx;
+    if (!mpctx->demuxer)
+        return M_PROPERTY_UNAVAILABLE;
+
+    if (action == M_PROPERTY_GET_TYPE) {
+        *(struct m_option *)arg = (struct m_option){.type = CONF_TYPE_NODE};
+        return M_PROPERTY_OK;
+    }
+    if (action != M_PROPERTY_GET)
+        return M_PROPERTY_NOT_IMPLEMENTED;
+
+    void *tmp = talloc_new(NULL);
+    struct demux_ctrl_cache_stats s = {.ta_parent = tmp};
+    if (demux_control(mpctx->demuxer, DEMUXER_CTRL_GET_CACHE_STATS, &s) < 1) {
+        talloc_free(tmp);
+        return M_PROPERTY_UNAVAILABLE;
+    }
+
+    struct mpv_node *r = (struct mpv_node *)arg;
+    node_init(r, MPV_FORMAT_NODE_MAP, NULL);
+
+    node_map_add_int64(r, "cache-seeks", s.cache_seeks);
+    node_map_add_int64(r, "low-level-seeks", s.low_level_seeks);
+    node_map_add_double(r, "seek-time", s.seek_time);
+    node_map_add_double(r, "seek-time-max", s.seek_time_max);
+    node_map_add_int64(r, "pruned-packets", s.pruned_packets);
+    node_map_add_int64(r, "pruned-bytes", s.pruned_bytes);
+    node_map_add_int64(r, "evicted-ranges", s.evicted_ranges);
+    node_map_add_int64(r, "evicted-bytes", s.evicted_bytes);
+
+    static const double limits[] = DEMUX_UNDERRUN_LIMITS;
+    struct mpv_node *buckets =
+        node_map_add(r, "underrun-buckets", MPV_FORMAT_NODE_ARRAY);
+    for (int n = 0; n < DEMUX_UNDERRUN_BUCKETS - 1; n++)
+        node_array_add(buckets, MPV_FORMAT_DOUBLE)->u.double_ = limits[n];
+
+    struct mpv_node *streams = node_map_add(r, "streams", MPV_FORMAT_NODE_ARRAY);
+    for (int n = 0; n < s.num_streams; n++) {
+        struct demux_stream_stats *st = &s.streams[n];
+        struct mpv_node *sub = node_array_add(streams, MPV_FORMAT_NODE_MAP);
+        node_map_add_int64(sub, "index", st->index);
+        node_map_add_string(sub, "type", stream_type_name(st->type));
+        node_map_add_double(sub, "underrun-time", st->underrun_time);
+        struct mpv_node *hist =
+            node_map_add(sub, "underruns", MPV_FORMAT_NODE_ARRAY);
+        for (int i = 0; i < DEMUX_UNDERRUN_BUCKETS; i++)
+            node_array_add(hist, MPV_FORMAT_INT64)->u.int64 = st->underruns[i];
+    }
+
+    talloc_free(tmp);
+    return M_PROPERTY_OK;
+}
+
+static int mp_property_stream_io_stats(void *ctx, struct m_property *prop,
+                                       int action, void *arg)
+{
+    MPContext *mpctx = ctx;
+    if (!mpctx->demuxer || !mpctx->demuxer->stream)
+        return M_PROPERTY_UNAVAILABLE;
+
+    if (action == M_PROPERTY_GET_TYPE) {
+        *(struct m_option *)arg = (struct m_option){.type = CONF_TYPE_NODE};
+        return M_PROPERTY_OK;
+    }
+    if (action != M_PROPERTY_GET)
+        return M_PROPERTY_NOT_IMPLEMENTED;
+
+    struct mpv_node *r = (struct mpv_node *)arg;
+    node_init(r, MPV_FORMAT_NODE_ARRAY, NULL);
+
+    // The cache wrappers come first, followed by the streams they read from.
+    for (struct stream *s = mpctx->demuxer->stream; s; s = s->underlying) {
+        struct stream_io_stats *st = &s->io_stats;
+        struct mpv_node *sub = node_array_add(r, MPV_FORMAT_NODE_MAP);
+        node_map_add_string(sub, "name", s->caching ? "cache" : s->info->name);
+        node_map_add_int64(sub, "reads", atomic_load(&st->reads));
+        node_map_add_int64(sub, "read-bytes", atomic_load(&st->read_bytes));
+        node_map_add_double(sub, "read-time", atomic_load(&st->read_time) / 1e6);
+        node_map_add_int64(sub, "seeks", atomic_load(&st->seeks));
+        node_map_add_int64(sub, "backward-seeks",
+                           atomic_load(&st->backward_seeks));
+        node_map_add_double(sub, "seek-time", atomic_load(&st->seek_time) / 1e6);
+        node_map_add_int64(sub, "controls", atomic_load(&st->controls));
+        struct mpv_node *hist =
+            node_map_add(sub, "read-sizes", MPV_FORMAT_NODE_ARRAY);
+        for (int n = 0; n < STREAM_READ_SIZE_BUCKETS; n++)
+            node_array_add(hist, MPV_FORMAT_INT64)->u.int64 =
+                atomic_load(&st->read_sizes[n]);
+    }
 
     return M_PROPERTY_OK;
 }
@@ -3894,6 +3999,8 @@ static const struct m_property mp_properties_base[] = {
     {"demuxer-cache-idle", mp_property_demuxer_cache_idle},
     {"demuxer-start-time", mp_property_demuxer_start_time},
     {"demuxer-cache-state", mp_property_demuxer_cache_state},
+    {"demuxer-cache-stats", mp_property_demuxer_cache_stats},
+    {"stream-io-stats", mp_property_stream_io_stats},
     {"cache-buffering-state", mp_property_cache_buffering},
     {"paused-for-cache", mp_property_paused_for_cache},
     {"demuxer-via-network", mp_property_demuxer_is_network},
@@ -4130,16 +4237,42 @@ uint64_t mp_get_property_event_mask(const char *name)
     return mask;
 }
 
+static struct m_property *find_property(struct command_ctx *ctx, bstr name)
+{
+    int lo = 0, hi = ctx->num_properties;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct m_property *prop = ctx->prop_index[mid];
+        int c = bstrcmp(name, bstr0(prop->name));
+        if (c == 0)
+            return prop;
+        if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static struct m_property *find_property_cb(void *mpctx, const char *name)
+{
+    struct command_ctx *ctx = ((struct MPContext *)mpctx)->command_ctx;
+    return find_property(ctx, m_property_lookup_name(name));
+}
+
 // Return an ID for the property. It might not be unique, but is good enough
 // for property change handling. Return -1 if property unknown.
 int mp_get_property_id(struct MPContext *mpctx, const char *name)
 {
     struct command_ctx *ctx = mpctx->command_ctx;
-    for (int n = 0; ctx->properties[n].name; n++) {
-        if (match_property(ctx->properties[n].name, name))
-            return n;
-    }
-    return -1;
+    // Same matching as match_property(): options and properties have the same
+    // ID, and sub-properties have the ID of their parent.
+    bstr bname = bstr0(name);
+    bstr_eatstart0(&bname, "options/");
+    bstr_split_tok(bname, "/", &bname, &(bstr){0});
+    struct m_property *prop = find_property(ctx, bname);
+    return prop ? prop - ctx->properties : -1;
 }
 
 static bool is_property_set(int action, void *val)
@@ -4164,7 +4297,8 @@ static int mp_property_do_silent(const char *name, int action, void *val,
 {
     struct command_ctx *cmd = ctx->command_ctx;
     cmd->silence_option_deprecations += 1;
-    int r = m_property_do(ctx->log, cmd->properties, name, action, val, ctx);
+    struct m_property *prop = find_property(cmd, m_property_lookup_name(name));
+    int r = m_property_do_prop(ctx->log, prop, name, action, val, ctx);
     cmd->silence_option_deprecations -= 1;
     if (r == M_PROPERTY_OK && is_property_set(action, val))
         mp_notify_property(ctx, (char *)name);
@@ -4197,8 +4331,7 @@ int mp_property_do(const char *name, int action, void *val,
 
 char *mp_property_expand_string(struct MPContext *mpctx, const char *str)
 {
-    struct command_ctx *ctx = mpctx->command_ctx;
-    return m_properties_expand_string(ctx->properties, str, mpctx);
+    return m_properties_expand_string(find_property_cb, str, mpctx);
 }
 
 // Before expanding properties, parse C-style escapes like "\n"
@@ -6062,6 +6195,13 @@ void command_uninit(struct MPContext *mpctx)
     mpctx->command_ctx = NULL;
 }
 
+static int compare_prop(const void *a, const void *b)
+{
+    const struct m_property *pa = *(struct m_property **)a;
+    const struct m_property *pb = *(struct m_property **)b;
+    return bstrcmp(bstr0(pa->name), bstr0(pb->name));
+}
+
 void command_init(struct MPContext *mpctx)
 {
     struct command_ctx *ctx = talloc(NULL, struct command_ctx);
@@ -6102,6 +6242,12 @@ void command_init(struct MPContext *mpctx)
 
         ctx->properties[count++] = prop;
     }
+
+    ctx->num_properties = count;
+    ctx->prop_index = talloc_array(ctx, struct m_property *, count);
+    for (int n = 0; n < count; n++)
+        ctx->prop_index[n] = &ctx->properties[n];
+    qsort(ctx->prop_index, count, sizeof(ctx->prop_index[0]), compare_prop);
 }
 
 static void command_event(struct MPContext *mpctx, int event, void *arg)
@@ -6194,7 +6340,8 @@ void mp_option_change_callback(void *ctx, struct m_config_option *co, int flags)
             talloc_free(cmd->cur_ipc_input);
             cmd->cur_ipc = talloc_strdup(cmd, opts->ipc_path);
             cmd->cur_ipc_input = talloc_strdup(cmd, opts->input_file);
-            mp_uninit_ipc(mpctx->ipc_ctx);
+            // An IPC client could be waiting for this very call.
+            mp_uninit_ipc(mpctx->ipc_ctx, false);
             mpctx->ipc_ctx = mp_init_ipc(mpctx->clients, mpctx->global);
         }
     }
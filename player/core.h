@@ -448,6 +448,8 @@ typedef struct MPContext {
     char *open_url;
     char *open_format;
     int open_url_flags;
+    double open_prefetch_secs;
+    int64_t open_prefetch_bytes;    // if >0, read ahead packets after opening
     // --- All fields below are owned by open_thread, unless open_done was set
     //     to true.
     struct demuxer *open_res_demuxer;
@@ -808,11 +808,25 @@ static void *open_demux_thread(void *ctx)
         .stream_flags = mpctx->open_url_flags,
         .initial_readahead = true,
     };
-    mpctx->open_res_demuxer =
+    struct demuxer *demux =
         demux_open_url(mpctx->open_url, &p, mpctx->open_cancel, mpctx->global);
+    mpctx->open_res_demuxer = demux;
 
-    if (mpctx->open_res_demuxer) {
+    if (demux) {
         MP_VERBOSE(mpctx, "Opening done: %s\n", mpctx->open_url);
+
+        if (mpctx->open_prefetch_bytes > 0 && !demux->fully_read) {
+            // Which tracks will be used is not known yet, so read all of
+            // them. Packets of tracks that are not selected on playback
+            // start are dropped then.
+            for (int n = 0; n < demux_get_num_stream(demux); n++) {
+                struct sh_stream *sh = demux_get_stream(demux, n);
+                demuxer_select_track(demux, sh, MP_NOPTS_VALUE, true);
+            }
+            demux_set_prefetch(demux, mpctx->open_prefetch_secs,
+                               mpctx->open_prefetch_bytes);
+            demux_start_thread(demux);
+        }
     } else {
         MP_VERBOSE(mpctx, "Opening failed or was aborted: %s\n", mpctx->open_url);
 
@@ -849,7 +863,10 @@ static void cancel_open(struct MPContext *mpctx)
 }
 
 // Setup all the field to open this url, and make sure a thread is running.
-static void start_open(struct MPContext *mpctx, char *url, int url_flags)
+// If prefetch is set, also read ahead packets within the --prefetch-playlist
+// limits.
+static void start_open(struct MPContext *mpctx, char *url, int url_flags,
+                       bool prefetch)
 {
     cancel_open(mpctx);
 
@@ -864,6 +881,8 @@ static void start_open(struct MPContext *mpctx, char *url, int url_flags)
     mpctx->open_url_flags = url_flags;
     if (mpctx->opts->load_unsafe_playlists)
         mpctx->open_url_flags = 0;
+    mpctx->open_prefetch_secs = mpctx->opts->prefetch_secs;
+    mpctx->open_prefetch_bytes = prefetch ? mpctx->opts->prefetch_bytes : 0;
 
     if (pthread_create(&mpctx->open_thread, NULL, open_demux_thread, mpctx)) {
         cancel_open(mpctx);
@@ -898,7 +917,7 @@ static void open_demux_reentrant(struct MPContext *mpctx)
     }
 
     if (!mpctx->open_active)
-        start_open(mpctx, url, mpctx->playing->stream_flags);
+        start_open(mpctx, url, mpctx->playing->stream_flags, false);
 
     // User abort should cancel the opener now.
     pthread_mutex_lock(&mpctx->lock);
@@ -914,6 +933,12 @@ static void open_demux_reentrant(struct MPContext *mpctx)
 
     if (mpctx->open_res_demuxer) {
         assert(mpctx->demuxer_cancel == mpctx->open_cancel);
+        if (mpctx->open_prefetch_bytes > 0) {
+            // The player takes over from here; keep the prefetched packets.
+            demux_set_prefetch(mpctx->open_res_demuxer, 0, 0);
+            if (!mpctx->opts->demuxer_thread)
+                demux_stop_thread(mpctx->open_res_demuxer);
+        }
         mpctx->demuxer = mpctx->open_res_demuxer;
         mpctx->open_res_demuxer = NULL;
         mpctx->open_cancel = NULL;
@@ -935,7 +960,7 @@ void prefetch_next(struct MPContext *mpctx)
     struct playlist_entry *new_entry = mp_next_file(mpctx, +1, false, false);
     if (new_entry && !mpctx->open_active && new_entry->filename) {
         MP_VERBOSE(mpctx, "Prefetching: %s\n", new_entry->filename);
-        start_open(mpctx, new_entry->filename, new_entry->stream_flags);
+        start_open(mpctx, new_entry->filename, new_entry->stream_flags, true);
     }
 }
 
@@ -158,7 +158,7 @@ void mp_destroy(struct MPContext *mpctx)
 {
     mp_shutdown_clients(mpctx);
 
-    mp_uninit_ipc(mpctx->ipc_ctx);
+    mp_uninit_ipc(mpctx->ipc_ctx, true);
     mpctx->ipc_ctx = NULL;
 
     uninit_audio_out(mpctx);
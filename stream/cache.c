@@ -32,6 +32,9 @@
 // the cache is active.
 #define CACHE_UPDATE_CONTROLS_TIME 2.0
 
+// Minimum time in seconds between two cache resizes with --cache-adaptive-secs.
+#define CACHE_ADAPT_INTERVAL 10.0
+
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -74,6 +77,9 @@ const struct m_sub_options stream_cache_conf = {
         OPT_INTRANGE("cache-backbuffer", back_buffer, 0, 0, 0x7fffffff),
         OPT_STRING("cache-file", file, M_OPT_FILE),
         OPT_INTRANGE("cache-file-size", file_max, 0, 0, 0x7fffffff),
+        OPT_INTRANGE("cache-connections", connections, 0, 1, 16),
+        OPT_DOUBLE("cache-adaptive-secs", adaptive_secs, M_OPT_MIN, .min = 0),
+        OPT_INTRANGE("cache-adaptive-min", adaptive_min, 0, 32, 0x7fffffff),
         {0}
     },
     .size = sizeof(struct mp_cache_opts),
@@ -84,9 +90,34 @@ const struct m_sub_options stream_cache_conf = {
         .seek_min = 500,
         .back_buffer = 10000,
         .file_max = 1024 * 1024,
+        .connections = 1,
+        .adaptive_min = 1024,
     },
 };
 
+// Size of the byte ranges fetched by segment workers.
+#define SEGMENT_SIZE (1024 * 1024)
+// Maximum amount of data segment workers read at once.
+#define SEGMENT_READ_SIZE (64 * 1024)
+// Number of failed reads after which parallel fetching is given up.
+#define SEGMENT_MAX_ERRORS 3
+
+// A byte range of the stream downloaded by a segment worker, ahead of the
+// sequential fill position.
+struct segment {
+    int64_t start, end;     // file range; start is -1 if unused
+    int64_t filled;         // [start, start + filled) has been downloaded
+    unsigned char *data;    // SEGMENT_SIZE bytes
+    bool busy;              // owned by a worker (which may change filled)
+    bool abort;             // range is not needed anymore
+    int errors;
+};
+
+struct segment_worker {
+    struct priv *s;
+    pthread_t thread;
+};
+
 // Note: (struct priv*)(cache->priv)->cache == cache
 struct priv {
     pthread_t cache_thread;
@@ -148,6 +179,27 @@ struct priv {
     struct mp_tags *stream_metadata;
     double start_pts;
     bool has_avseek;
+
+    // Parallel range fetching with --cache-connections
+    struct segment *segments;
+    int num_segments;
+    struct segment_worker *workers;
+    int num_workers;
+    struct mp_cancel *segments_cancel;
+    pthread_cond_t segments_wakeup; // signals segment workers
+    bool segments_terminate;
+    bool segments_failed;   // fall back to reading the stream sequentially
+    bool segments_waiting;  // cache thread waits for a segment worker
+
+    // Adaptive cache size with --cache-adaptive-secs (cache thread only)
+    double adaptive_secs;
+    int64_t adaptive_min, adaptive_max;
+    int64_t base_back_size;
+    int64_t base_seek_limit;
+    int64_t rate_last_pos;  // read_filepos at rate_last_time
+    double rate_last_time;
+    double rate;            // estimated consumption rate in bytes/s
+    double last_resize;
 };
 
 enum {
@@ -244,6 +296,218 @@ static bool needs_seek(struct priv *s, int64_t pos)
     return pos < s->min_filepos || pos > s->max_filepos + s->seek_limit;
 }
 
+static bool segments_active(struct priv *s)
+{
+    return s->num_workers && !s->segments_failed;
+}
+
+static struct segment *find_segment(struct priv *s, int64_t pos)
+{
+    for (int n = 0; n < s->num_segments; n++) {
+        struct segment *seg = &s->segments[n];
+        if (seg->start >= 0 && !seg->abort && pos >= seg->start &&
+            pos < seg->end)
+            return seg;
+    }
+    return NULL;
+}
+
+// Assign segments to the ranges following the fill position, and release the
+// segments outside of this window. Runs with the mutex held.
+static void plan_segments(struct priv *s)
+{
+    int64_t start = s->max_filepos / SEGMENT_SIZE * SEGMENT_SIZE;
+    int64_t end = start + s->num_segments * (int64_t)SEGMENT_SIZE;
+    if (s->stream_size >= 0)
+        end = MPMIN(end, s->stream_size);
+
+    for (int n = 0; n < s->num_segments; n++) {
+        struct segment *seg = &s->segments[n];
+        if (seg->start >= 0 && (seg->start < start || seg->start >= end)) {
+            if (seg->busy) {
+                seg->abort = true;
+            } else {
+                seg->start = -1;
+            }
+        }
+    }
+
+    // Ranges closer to the fill position are assigned (and fetched) first.
+    for (int64_t pos = start; pos < end; pos += SEGMENT_SIZE) {
+        if (find_segment(s, pos))
+            continue;
+        struct segment *seg = NULL;
+        for (int n = 0; n < s->num_segments; n++) {
+            if (s->segments[n].start < 0 && !s->segments[n].busy) {
+                seg = &s->segments[n];
+                break;
+            }
+        }
+        if (!seg)
+            break;
+        seg->start = pos;
+        seg->end = MPMIN(pos + SEGMENT_SIZE, end);
+        seg->filled = 0;
+        seg->errors = 0;
+    }
+
+    pthread_cond_broadcast(&s->segments_wakeup);
+}
+
+// Copy downloaded data at max_filepos to dst. Returns the number of bytes
+// copied, 0 on EOF, or -1 if the data is not available yet.
+// Runs in the cache thread, with the mutex held.
+static int read_segments(struct priv *s, unsigned char *dst, int64_t len)
+{
+    int64_t pos = s->max_filepos;
+    if (s->stream_size >= 0 && pos >= s->stream_size)
+        return 0;
+
+    plan_segments(s);
+
+    struct segment *seg = find_segment(s, pos);
+    if (!seg || pos >= seg->start + seg->filled)
+        return -1;
+
+    len = MPMIN(len, seg->start + seg->filled - pos);
+    memcpy(dst, seg->data + (pos - seg->start), len);
+
+    // Recycle it for the next range once it's completely consumed.
+    if (pos + len == seg->end && !seg->busy) {
+        seg->start = -1;
+        plan_segments(s);
+    }
+
+    return len;
+}
+
+// Return the next segment that needs to be downloaded, or NULL.
+// Runs in a segment worker, with the mutex held.
+static struct segment *pick_segment(struct priv *s)
+{
+    struct segment *best = NULL;
+    for (int n = 0; n < s->num_segments; n++) {
+        struct segment *seg = &s->segments[n];
+        if (seg->start >= 0 && !seg->busy && !seg->abort &&
+            seg->start + seg->filled < seg->end &&
+            (!best || seg->start < best->start))
+            best = seg;
+    }
+    return best;
+}
+
+static void *segment_worker_thread(void *arg)
+{
+    struct segment_worker *w = arg;
+    struct priv *s = w->s;
+    mpthread_set_name("cache-segment");
+
+    // Every worker uses its own connection.
+    stream_t *stream = stream_create(s->stream->url, STREAM_READ,
+                                     s->segments_cancel, s->stream->global);
+
+    pthread_mutex_lock(&s->mutex);
+    if (!stream) {
+        MP_WARN(s, "Could not open additional connection.\n");
+        s->segments_failed = true;
+        pthread_cond_broadcast(&s->wakeup);
+    }
+    while (stream && !s->segments_terminate && !s->segments_failed) {
+        struct segment *seg = pick_segment(s);
+        if (!seg) {
+            pthread_cond_wait(&s->segments_wakeup, &s->mutex);
+            continue;
+        }
+        seg->busy = true;
+        pthread_mutex_unlock(&s->mutex);
+
+        // Only this thread changes the segment while it's busy.
+        bool ok = stream_seek(stream, seg->start + seg->filled);
+        while (ok) {
+            int64_t want = MPMIN(seg->end - seg->start - seg->filled,
+                                 SEGMENT_READ_SIZE);
+            if (want <= 0)
+                break;
+            int r = stream_read_partial(stream, seg->data + seg->filled, want);
+            if (r <= 0) {
+                ok = false;
+                break;
+            }
+            pthread_mutex_lock(&s->mutex);
+            seg->filled += r;
+            bool stop = seg->abort || s->segments_terminate;
+            pthread_cond_broadcast(&s->wakeup);
+            pthread_mutex_unlock(&s->mutex);
+            if (stop)
+                break;
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        if (!ok && !mp_cancel_test(s->segments_cancel)) {
+            seg->errors += 1;
+            MP_WARN(s, "Fetching range at %"PRId64" failed.\n",
+                    seg->start + seg->filled);
+            if (seg->errors >= SEGMENT_MAX_ERRORS) {
+                MP_WARN(s, "Disabling parallel fetching.\n");
+                s->segments_failed = true;
+            }
+        }
+        seg->busy = false;
+        if (seg->abort) {
+            seg->start = -1;
+            seg->abort = false;
+        }
+        pthread_cond_broadcast(&s->wakeup);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    free_stream(stream);
+    return NULL;
+}
+
+static void init_segments(struct priv *s, int connections)
+{
+    s->segments_cancel = mp_cancel_new(s);
+    pthread_cond_init(&s->segments_wakeup, NULL);
+
+    // Twice as many segments as connections, so that finished segments can
+    // be consumed while the workers proceed with the next ranges.
+    s->num_segments = connections * 2;
+    s->segments = talloc_zero_array(s, struct segment, s->num_segments);
+    for (int n = 0; n < s->num_segments; n++) {
+        s->segments[n] = (struct segment){
+            .start = -1,
+            .data = talloc_size(s->segments, SEGMENT_SIZE),
+        };
+    }
+
+    s->workers = talloc_zero_array(s, struct segment_worker, connections);
+    for (int n = 0; n < connections; n++) {
+        struct segment_worker *w = &s->workers[n];
+        w->s = s;
+        if (pthread_create(&w->thread, NULL, segment_worker_thread, w))
+            break;
+        s->num_workers++;
+    }
+
+    MP_VERBOSE(s, "Using %d connections for parallel fetching.\n",
+               s->num_workers);
+}
+
+static void uninit_segments(struct priv *s)
+{
+    if (!s->segments_cancel)
+        return;
+    pthread_mutex_lock(&s->mutex);
+    s->segments_terminate = true;
+    pthread_cond_broadcast(&s->segments_wakeup);
+    pthread_mutex_unlock(&s->mutex);
+    mp_cancel_trigger(s->segments_cancel);
+    for (int n = 0; n < s->num_workers; n++)
+        pthread_join(s->workers[n].thread, NULL);
+    pthread_cond_destroy(&s->segments_wakeup);
+}
+
 static bool cache_update_stream_position(struct priv *s)
 {
     int64_t read = s->read_filepos;
@@ -257,6 +521,10 @@ static bool cache_update_stream_position(struct priv *s)
         cache_drop_contents(s);
     }
 
+    // The segment workers use their own connections.
+    if (segments_active(s))
+        return true;
+
     if (stream_tell(s->stream) != s->max_filepos && s->seekable) {
         MP_VERBOSE(s, "Seeking underlying stream: %"PRId64" -> %"PRId64"\n",
                    stream_tell(s->stream), s->max_filepos);
@@ -276,6 +544,8 @@ static void cache_fill(struct priv *s)
     bool read_attempted = false;
     int len = 0;
 
+    s->segments_waiting = false;
+
     if (!cache_update_stream_position(s))
         goto done;
 
@@ -321,10 +591,19 @@ static void cache_fill(struct priv *s)
     if (s->min_filepos < (read - back2))
         s->min_filepos = read - back2;
 
-    // The read call might take a long time and block, so drop the lock.
-    pthread_mutex_unlock(&s->mutex);
-    len = stream_read_partial(s->stream, &s->buffer[pos], space);
-    pthread_mutex_lock(&s->mutex);
+    if (segments_active(s)) {
+        len = read_segments(s, &s->buffer[pos], space);
+        if (len < 0) {
+            s->segments_waiting = true;
+            len = 0;
+            goto done;
+        }
+    } else {
+        // The read call might take a long time and block, so drop the lock.
+        pthread_mutex_unlock(&s->mutex);
+        len = stream_read_partial(s->stream, &s->buffer[pos], space);
+        pthread_mutex_lock(&s->mutex);
+    }
 
     // Do this after reading a block, because at least libdvdnav updates the
     // stream position only after actually reading something after a seek.
@@ -347,7 +626,8 @@ done: ;
     if (read_attempted)
         s->eof = len <= 0;
     if (!prev_eof && s->eof) {
-        s->eof_pos = stream_tell(s->stream);
+        s->eof_pos = segments_active(s) ? s->max_filepos
+                                        : stream_tell(s->stream);
         MP_VERBOSE(s, "EOF reached.\n");
     }
     s->idle = s->eof || !read_attempted;
@@ -428,6 +708,49 @@ static int resize_cache(struct priv *s, int64_t size)
     return STREAM_OK;
 }
 
+// Estimate the rate at which the stream is consumed, and resize the cache so
+// that it holds adaptive_secs worth of data. Runs in the cache thread.
+static void adapt_cache_size(struct priv *s)
+{
+    if (s->adaptive_secs <= 0)
+        return;
+
+    double now = mp_time_sec();
+    int64_t delta = s->read_filepos - s->rate_last_pos;
+    double dt = now - s->rate_last_time;
+    s->rate_last_pos = s->read_filepos;
+    s->rate_last_time = now;
+
+    // Ignore seeks and paused playback.
+    if (delta <= 0 || delta > s->buffer_size || dt <= 0)
+        return;
+    double rate = delta / dt;
+    s->rate = s->rate > 0 ? s->rate * 0.7 + rate * 0.3 : rate;
+
+    rate = s->rate;
+    if (s->stream_size > 0 && s->stream_time_length > 0)
+        rate = MPMAX(rate, s->stream_size / s->stream_time_length);
+
+    int64_t target = MPCLAMP(rate * s->adaptive_secs, s->adaptive_min,
+                             s->adaptive_max);
+    int64_t cur = s->buffer_size - s->back_size;
+    if (target <= cur * 5 / 4 && target >= cur * 3 / 4)
+        return;
+    if (now - s->last_resize < CACHE_ADAPT_INTERVAL)
+        return;
+    s->last_resize = now;
+
+    MP_VERBOSE(s, "Consumption rate %.0f KiB/s, resizing cache.\n",
+               rate / 1024);
+    int64_t old_back_size = s->back_size;
+    s->back_size = MPMIN(s->base_back_size, target);
+    s->seek_limit = s->base_seek_limit;
+    if (resize_cache(s, target) != STREAM_OK) {
+        MP_WARN(s, "Failed to resize cache.\n");
+        s->back_size = old_back_size;
+    }
+}
+
 static void update_cached_controls(struct priv *s)
 {
     int64_t i64;
@@ -554,6 +877,7 @@ static void *cache_thread(void *arg)
     while (s->control != CACHE_CTRL_QUIT) {
         if (mp_time_sec() - last > CACHE_UPDATE_CONTROLS_TIME) {
             update_cached_controls(s);
+            adapt_cache_size(s);
             last = mp_time_sec();
         }
         if (s->control > 0) {
@@ -569,7 +893,9 @@ static void *cache_thread(void *arg)
             pthread_cond_signal(&s->wakeup);
             s->control = CACHE_CTRL_NONE;
         }
-        if (s->idle && s->control == CACHE_CTRL_NONE) {
+        if ((s->idle || s->segments_waiting) &&
+            s->control == CACHE_CTRL_NONE)
+        {
             struct timespec ts = mp_rel_time_to_timespec(CACHE_IDLE_SLEEP_TIME);
             pthread_cond_timedwait(&s->wakeup, &s->mutex, &ts);
         }
@@ -580,6 +906,21 @@ static void *cache_thread(void *arg)
     return NULL;
 }
 
+// Wake up the cache thread, possibly make it read more data ahead. This is
+// throttled to reduce excessive wakeups during normal reading (using the amount
+// of bytes after which the cache thread most likely can actually read new
+// data). Called with the mutex held.
+static void wakeup_after_read(struct priv *s, int64_t readb)
+{
+    if (s->eof)
+        return;
+    s->bytes_until_wakeup -= readb;
+    if (s->bytes_until_wakeup <= 0) {
+        s->bytes_until_wakeup = MPMAX(FILL_LIMIT, s->stream->read_chunk);
+        pthread_cond_signal(&s->wakeup);
+    }
+}
+
 static int cache_fill_buffer(struct stream *cache, char *buffer, int max_len)
 {
     struct priv *s = cache->priv;
@@ -613,17 +954,37 @@ static int cache_fill_buffer(struct stream *cache, char *buffer, int max_len)
         }
     }
 
-    if (!s->eof) {
-        // wakeup the cache thread, possibly make it read more data ahead
-        // this is throttled to reduce excessive wakeups during normal reading
-        // (using the amount of bytes after which the cache thread most likely
-        // can actually read new data)
-        s->bytes_until_wakeup -= readb;
-        if (s->bytes_until_wakeup <= 0) {
-            s->bytes_until_wakeup = MPMAX(FILL_LIMIT, s->stream->read_chunk);
-            pthread_cond_signal(&s->wakeup);
-        }
+    wakeup_after_read(s, readb);
+    pthread_mutex_unlock(&s->mutex);
+    return readb;
+}
+
+// Copy the data that is already cached into the buffers, without waiting.
+// If nothing is cached at the read position, this returns 0, and the caller
+// falls back to cache_fill_buffer().
+static int cache_fill_buffer_v(struct stream *cache, struct stream_iovec *iov,
+                               int num_iov)
+{
+    struct priv *s = cache->priv;
+    assert(s->cache_thread_running);
+
+    pthread_mutex_lock(&s->mutex);
+
+    int64_t want = 0;
+    for (int n = 0; n < num_iov; n++)
+        want += iov[n].len;
+    s->read_min = s->read_filepos + want + 64 * 1024;
+
+    int64_t readb = 0;
+    for (int n = 0; n < num_iov; n++) {
+        size_t r = read_buffer(s, iov[n].data, iov[n].len, s->read_filepos);
+        s->read_filepos += r;
+        readb += r;
+        if (r < iov[n].len)
+            break;
     }
+
+    wakeup_after_read(s, readb);
     pthread_mutex_unlock(&s->mutex);
     return readb;
 }
@@ -723,6 +1084,7 @@ static void cache_uninit(stream_t *cache)
         pthread_mutex_unlock(&s->mutex);
         pthread_join(s->cache_thread, NULL);
     }
+    uninit_segments(s);
     pthread_mutex_destroy(&s->mutex);
     pthread_cond_destroy(&s->wakeup);
     free(s->buffer);
@@ -751,7 +1113,22 @@ int stream_cache_init(stream_t *cache, stream_t *stream,
 
     s->stream_size = stream_get_size(stream);
 
-    if (resize_cache(s, opts->size * 1024ULL) != STREAM_OK) {
+    // With an adaptive size, --cache is the maximum, and the cache starts
+    // with the minimum size.
+    int64_t size = opts->size * 1024ULL;
+    if (opts->adaptive_secs > 0) {
+        s->adaptive_secs = opts->adaptive_secs;
+        s->adaptive_max = size;
+        s->adaptive_min = MPMIN(opts->adaptive_min * 1024LL, size);
+        s->base_back_size = s->back_size;
+        s->base_seek_limit = s->seek_limit;
+        s->rate_last_time = mp_time_sec();
+        s->last_resize = s->rate_last_time;
+        s->back_size = MPMIN(s->back_size, s->adaptive_min);
+        size = s->adaptive_min;
+    }
+
+    if (resize_cache(s, size) != STREAM_OK) {
         MP_ERR(s, "Failed to allocate cache buffer.\n");
         talloc_free(s);
         return -1;
@@ -766,6 +1143,7 @@ int stream_cache_init(stream_t *cache, stream_t *stream,
 
     cache->seek = cache_seek;
     cache->fill_buffer = cache_fill_buffer;
+    cache->fill_buffer_v = cache_fill_buffer_v;
     cache->control = cache_control;
     cache->close = cache_uninit;
 
@@ -775,6 +1153,12 @@ int stream_cache_init(stream_t *cache, stream_t *stream,
 
     s->seekable = stream->seekable;
 
+    // Fetching ranges in parallel requires reopening the stream by URL, and
+    // the file cache would be bypassed.
+    if (opts->connections > 1 && stream->is_network && stream->seekable &&
+        !stream->caching && s->stream_size > 0)
+        init_segments(s, opts->connections);
+
     if (pthread_create(&s->cache_thread, NULL, cache_thread, s) != 0) {
         MP_ERR(s, "Starting cache thread failed.\n");
         return -1;
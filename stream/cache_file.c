@@ -17,6 +17,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "osdep/io.h"
 
@@ -27,15 +30,36 @@
 
 #include "stream.h"
 
-#define BLOCK_SIZE 1024LL
+#define BLOCK_SIZE (64 * 1024LL)
 #define BLOCK_ALIGN(p) ((p) & ~(BLOCK_SIZE - 1))
 
+// A named cache file starts with this header, followed by the URL of the
+// cached stream, the block map, and the data blocks (aligned to BLOCK_SIZE).
+// The block map is written on closing, and the file is marked as clean only
+// after that. A file that was not closed properly is not reused.
+#define HEADER_MAGIC "mpvfcac1"
+
+struct cache_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t url_len;
+    int64_t size;           // size of the cached stream
+    int64_t max_size;       // --cache-file-size, determines the file layout
+    uint32_t clean;         // block map is valid
+    uint32_t reserved;
+};
+
 struct priv {
     struct stream *original;
-    FILE *cache_file;
+    FILE *tmp_file;         // for anonymous files
+    int fd;
     uint8_t *block_bits;    // 1 bit for each BLOCK_SIZE, whether block was read
+    size_t block_bits_size;
+    uint8_t *block_buf;     // BLOCK_SIZE bytes
     int64_t size;           // currently known size
     int64_t max_size;       // max. size for block_bits and cache_file
+    bool persistent;        // block map is saved in the file
+    int64_t data_offset;    // file position of the first block
 };
 
 static bool test_bit(struct priv *p, int64_t pos)
@@ -55,6 +79,124 @@ static void set_bit(struct priv *p, int64_t pos, bool bit)
     p->block_bits[block / 8] = (p->block_bits[block / 8] & ~m) | (bit ? m : 0);
 }
 
+// Read/write exactly len bytes at the given file position. Return false on
+// errors and on short reads.
+static bool file_read(int fd, int64_t pos, void *buf, size_t len)
+{
+    while (len > 0) {
+#ifdef __MINGW32__
+        if (lseek(fd, pos, SEEK_SET) == (off_t)-1)
+            return false;
+        ssize_t r = read(fd, buf, len);
+#else
+        ssize_t r = pread(fd, buf, len, pos);
+#endif
+        if (r <= 0)
+            return false;
+        buf = (char *)buf + r;
+        pos += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool file_write(int fd, int64_t pos, const void *buf, size_t len)
+{
+    while (len > 0) {
+#ifdef __MINGW32__
+        if (lseek(fd, pos, SEEK_SET) == (off_t)-1)
+            return false;
+        ssize_t r = write(fd, buf, len);
+#else
+        ssize_t r = pwrite(fd, buf, len, pos);
+#endif
+        if (r <= 0)
+            return false;
+        buf = (const char *)buf + r;
+        pos += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool write_header(struct priv *p, bool clean)
+{
+    const char *url = p->original->url;
+    struct cache_header hdr = {
+        .block_size = BLOCK_SIZE,
+        .url_len = strlen(url),
+        .size = p->size,
+        .max_size = p->max_size,
+        .clean = clean,
+    };
+    memcpy(hdr.magic, HEADER_MAGIC, sizeof(hdr.magic));
+    return file_write(p->fd, 0, &hdr, sizeof(hdr)) &&
+           file_write(p->fd, sizeof(hdr), url, hdr.url_len);
+}
+
+// Restore the block map if the file caches the same stream. Return false if
+// the file can't be used at all.
+static bool load_block_map(stream_t *s)
+{
+    struct priv *p = s->priv;
+    const char *url = p->original->url;
+    int64_t map_offset = sizeof(struct cache_header) + strlen(url);
+    p->data_offset = (map_offset + p->block_bits_size + BLOCK_SIZE - 1) /
+                     BLOCK_SIZE * BLOCK_SIZE;
+
+    struct cache_header hdr;
+    if (file_read(p->fd, 0, &hdr, sizeof(hdr)) &&
+        memcmp(hdr.magic, HEADER_MAGIC, sizeof(hdr.magic)) == 0 &&
+        hdr.block_size == BLOCK_SIZE && hdr.url_len == strlen(url) &&
+        hdr.size == p->size && hdr.max_size == p->max_size && hdr.clean)
+    {
+        char *file_url = talloc_size(NULL, hdr.url_len);
+        bool ok = file_read(p->fd, sizeof(hdr), file_url, hdr.url_len) &&
+                  memcmp(file_url, url, hdr.url_len) == 0 &&
+                  file_read(p->fd, map_offset, p->block_bits,
+                            p->block_bits_size);
+        talloc_free(file_url);
+        if (ok) {
+            MP_VERBOSE(s, "reusing blocks from cache file\n");
+        } else {
+            memset(p->block_bits, 0, p->block_bits_size);
+        }
+    }
+
+    // Until the block map is written again, the file is inconsistent.
+    return write_header(p, false);
+}
+
+static void save_block_map(stream_t *s)
+{
+    struct priv *p = s->priv;
+    int64_t map_offset = sizeof(struct cache_header) + strlen(p->original->url);
+    if (!file_write(p->fd, map_offset, p->block_bits, p->block_bits_size) ||
+        !write_header(p, true))
+        MP_ERR(s, "could not write cache file block map\n");
+}
+
+// Fetch the block at pos from the original stream into block_buf, and write
+// it to the cache file. Return the number of bytes read, or -1 on error.
+static int read_block(stream_t *s, int64_t aligned)
+{
+    struct priv *p = s->priv;
+    stream_seek(p->original, aligned);
+    int r = stream_read(p->original, p->block_buf, BLOCK_SIZE);
+    if (r < BLOCK_SIZE) {
+        if (p->size < 0) {
+            MP_WARN(s, "suspected EOF\n");
+        } else if (aligned + r < p->size) {
+            MP_ERR(s, "unexpected EOF\n");
+            return -1;
+        }
+    }
+    if (!file_write(p->fd, p->data_offset + aligned, p->block_buf, r))
+        return -1;
+    set_bit(p, aligned, 1);
+    return r;
+}
+
 static int fill_buffer(stream_t *s, char *buffer, int max_len)
 {
     struct priv *p = s->priv;
@@ -72,33 +214,31 @@ static int fill_buffer(stream_t *s, char *buffer, int max_len)
             set_bit(p, BLOCK_ALIGN(p->size), 0);
         p->size = MPMIN(p->max_size, new_size);
     }
+    // Limit to max. known file size
+    if (p->size >= 0)
+        max_len = MPMIN(max_len, p->size - s->pos);
+    if (max_len <= 0)
+        return 0;
+
     int64_t aligned = BLOCK_ALIGN(s->pos);
     if (!test_bit(p, aligned)) {
-        char tmp[BLOCK_SIZE];
-        stream_seek(p->original, aligned);
-        int r = stream_read(p->original, tmp, BLOCK_SIZE);
-        if (r < BLOCK_SIZE) {
-            if (p->size < 0) {
-                MP_WARN(s, "suspected EOF\n");
-            } else if (aligned + r < p->size) {
-                MP_ERR(s, "unexpected EOF\n");
-                return -1;
-            }
-        }
-        if (fseeko(p->cache_file, aligned, SEEK_SET))
+        // Return the fetched block directly instead of reading it back.
+        int r = read_block(s, aligned);
+        if (r < 0)
             return -1;
-        if (fwrite(tmp, r, 1, p->cache_file) != 1)
-            return -1;
-        set_bit(p, aligned, 1);
+        int len = MPCLAMP(aligned + r - s->pos, 0, max_len);
+        memcpy(buffer, p->block_buf + (s->pos - aligned), len);
+        return len;
     }
-    if (fseeko(p->cache_file, s->pos, SEEK_SET))
+
+    // Read all following blocks that are already cached at once.
+    int64_t end = aligned + BLOCK_SIZE;
+    while (end < s->pos + max_len && test_bit(p, end))
+        end += BLOCK_SIZE;
+    max_len = MPMIN(max_len, end - s->pos);
+    if (!file_read(p->fd, p->data_offset + s->pos, buffer, max_len))
         return -1;
-    // align/limit to blocks
-    max_len = MPMIN(max_len, BLOCK_SIZE - (s->pos % BLOCK_SIZE));
-    // Limit to max. known file size
-    if (p->size >= 0)
-        max_len = MPMIN(max_len, p->size - s->pos);
-    return fread(buffer, 1, max_len, p->cache_file);
+    return max_len;
 }
 
 static int seek(stream_t *s, int64_t newpos)
@@ -115,8 +255,13 @@ static int control(stream_t *s, int cmd, void *arg)
 static void s_close(stream_t *s)
 {
     struct priv *p = s->priv;
-    if (p->cache_file)
-        fclose(p->cache_file);
+    if (p->persistent)
+        save_block_map(s);
+    if (p->tmp_file) {
+        fclose(p->tmp_file);
+    } else if (p->fd >= 0) {
+        close(p->fd);
+    }
     talloc_free(p);
 }
 
@@ -132,22 +277,45 @@ int stream_file_cache_init(stream_t *cache, stream_t *stream,
         return -1;
     }
 
+    struct priv *p = talloc_zero(NULL, struct priv);
+    p->original = stream;
+    p->fd = -1;
+    p->max_size = opts->file_max * 1024LL;
+    p->size = MPMIN(p->max_size, stream_get_size(stream));
+
     bool use_anon_file = strcmp(opts->file, "TMP") == 0;
-    FILE *file = use_anon_file ? tmpfile() : fopen(opts->file, "wb+");
-    if (!file) {
+    if (use_anon_file) {
+        p->tmp_file = tmpfile();
+        if (p->tmp_file)
+            p->fd = fileno(p->tmp_file);
+    } else {
+        p->fd = open(opts->file, O_RDWR | O_CREAT | O_BINARY | O_CLOEXEC,
+                     0666);
+    }
+    if (p->fd < 0) {
         MP_ERR(cache, "can't open cache file '%s'\n", opts->file);
+        if (p->tmp_file)
+            fclose(p->tmp_file);
+        talloc_free(p);
         return -1;
     }
 
-    struct priv *p = talloc_zero(NULL, struct priv);
-
     cache->priv = p;
-    p->original = stream;
-    p->cache_file = file;
-    p->max_size = opts->file_max * 1024LL;
 
-    // file_max can be INT_MAX, so this is at most about 256MB
-    p->block_bits = talloc_zero_size(p, (p->max_size / BLOCK_SIZE + 1) / 8 + 1);
+    // file_max can be INT_MAX, so this is at most about 4MB
+    p->block_bits_size = (p->max_size / BLOCK_SIZE + 1) / 8 + 1;
+    p->block_bits = talloc_zero_size(p, p->block_bits_size);
+    p->block_buf = talloc_size(p, BLOCK_SIZE);
+
+    // Only streams with known size can be recognized when reopening them.
+    if (!use_anon_file && p->size >= 0) {
+        if (!load_block_map(cache)) {
+            MP_ERR(cache, "can't write cache file '%s'\n", opts->file);
+            s_close(cache);
+            return -1;
+        }
+        p->persistent = true;
+    }
 
     cache->seek = seek;
     cache->fill_buffer = fill_buffer;
@@ -76,6 +76,7 @@ extern const stream_info_t stream_info_rar;
 extern const stream_info_t stream_info_edl;
 extern const stream_info_t stream_info_libarchive;
 extern const stream_info_t stream_info_cb;
+extern const stream_info_t stream_info_shm;
 
 static const stream_info_t *const stream_list[] = {
 #if HAVE_CDDA
@@ -109,6 +110,9 @@ static const stream_info_t *const stream_list[] = {
 #if HAVE_LIBARCHIVE
     &stream_info_libarchive,
 #endif
+#if HAVE_SHM_STREAM
+    &stream_info_shm,
+#endif
 
     &stream_info_memory,
     &stream_info_null,
@@ -337,6 +341,25 @@ stream_t *open_output_stream(const char *filename, struct mpv_global *global)
     return stream_create(filename, STREAM_WRITE, NULL, global);
 }
 
+// Record a call to fill_buffer or fill_buffer_v, which started at start (in
+// mp_time_us() time) and returned res.
+static void account_read(stream_t *s, int64_t start, int res)
+{
+    struct stream_io_stats *st = &s->io_stats;
+    int64_t end = mp_time_us();
+    atomic_fetch_add(&st->reads, 1);
+    atomic_fetch_add(&st->read_time, end - start);
+    if (res > 0) {
+        atomic_fetch_add(&st->read_bytes, res);
+        int n = 0;
+        while (n < STREAM_READ_SIZE_BUCKETS - 1 &&
+               res > STREAM_READ_SIZE_LIMIT(n))
+            n++;
+        atomic_fetch_add(&st->read_sizes[n], 1);
+    }
+    MP_STATS(s, "range-timed %"PRId64" %"PRId64" read", start, end);
+}
+
 // Read function bypassing the local stream buffer. This will not write into
 // s->buffer, but into buf[0..len] instead.
 // Returns 0 on error or EOF, and length of bytes read on success.
@@ -346,8 +369,11 @@ static int stream_read_unbuffered(stream_t *s, void *buf, int len)
     int res = 0;
     s->buf_pos = s->buf_len = 0;
     // we will retry even if we already reached EOF previously.
-    if (s->fill_buffer && !mp_cancel_test(s->cancel))
+    if (s->fill_buffer && !mp_cancel_test(s->cancel)) {
+        int64_t start = mp_time_us();
         res = s->fill_buffer(s, buf, len);
+        account_read(s, start, res);
+    }
     if (res <= 0) {
         s->eof = 1;
         return 0;
@@ -375,6 +401,39 @@ int stream_fill_buffer(stream_t *s)
     return stream_fill_buffer_by(s, STREAM_BUFFER_SIZE);
 }
 
+// Return how many bytes can be accessed directly at the current position
+// (see stream.get_mapped), and set *data to them. Only possible if the stream
+// buffer is empty, because the mapped data starts at s->pos.
+static int stream_get_mapped(stream_t *s, unsigned char **data)
+{
+    if (!s->get_mapped || s->buf_pos != s->buf_len || s->sector_size ||
+        mp_cancel_test(s->cancel))
+        return 0;
+    int64_t avail = s->get_mapped(s, s->pos, data);
+    return MPCLAMP(avail, 0, INT_MAX);
+}
+
+// Seek backward by accessing mapped data before the current position, which
+// works even with non-seekable streams that still keep it around.
+static bool stream_seek_mapped(stream_t *s, int64_t pos)
+{
+    unsigned char *data;
+    if (!s->get_mapped || s->sector_size || s->get_mapped(s, pos, &data) <= 0)
+        return false;
+    s->buf_pos = s->buf_len = 0;
+    s->pos = pos;
+    return true;
+}
+
+// Skip len bytes of data returned by stream_get_mapped().
+static void stream_skip_mapped(stream_t *s, int len)
+{
+    s->buf_pos = s->buf_len = 0;
+    s->pos += len;
+    if (len > 0)
+        s->eof = 0;
+}
+
 // Read between 1..buf_size bytes of data, return how much data has been read.
 // Return 0 on EOF, error, or if buf_size was 0.
 int stream_read_partial(stream_t *s, char *buf, int buf_size)
@@ -383,6 +442,14 @@ int stream_read_partial(stream_t *s, char *buf, int buf_size)
     assert(buf_size >= 0);
     if (s->buf_pos == s->buf_len && buf_size > 0) {
         s->buf_pos = s->buf_len = 0;
+        unsigned char *data;
+        int avail = stream_get_mapped(s, &data);
+        if (avail > 0) {
+            int len = MPMIN(buf_size, avail);
+            memcpy(buf, data, len);
+            stream_skip_mapped(s, len);
+            return len;
+        }
         // Do a direct read, but only if there's no sector alignment requirement
         // Also, small reads will be more efficient with buffering & copying
         if (!s->sector_size && buf_size >= STREAM_BUFFER_SIZE)
@@ -414,6 +481,82 @@ int stream_read(stream_t *s, char *mem, int total)
     return total;
 }
 
+// Maximum number of buffers passed to fill_buffer_v at once.
+#define STREAM_MAX_IOV 64
+
+// Let fill_buffer_v read into the remaining buffers, starting at offset done
+// in iov[0]. Returns the number of bytes read.
+static int stream_read_unbuffered_v(stream_t *s, struct stream_iovec *iov,
+                                    int num_iov, int done)
+{
+    struct stream_iovec rest[STREAM_MAX_IOV];
+    int num = 0;
+    int64_t size = 0;
+    for (int n = 0; n < num_iov && num < STREAM_MAX_IOV; n++) {
+        int skip = n == 0 ? done : 0;
+        if (size + iov[n].len - skip > INT_MAX / 2)
+            break;
+        rest[num++] = (struct stream_iovec){
+            .data = (char *)iov[n].data + skip,
+            .len = iov[n].len - skip,
+        };
+        size += rest[num - 1].len;
+    }
+    if (!num || mp_cancel_test(s->cancel))
+        return 0;
+    int64_t start = mp_time_us();
+    int res = s->fill_buffer_v(s, rest, num);
+    account_read(s, start, res);
+    if (res <= 0)
+        return 0;
+    s->eof = 0;
+    s->pos += res;
+    return res;
+}
+
+// Read into each of the num_iov buffers in order, as if stream_read() was
+// called for each of them. Return the total number of bytes read, which is
+// less than the total size of the buffers only on EOF or errors.
+// Streams implementing fill_buffer_v read the data directly into the buffers
+// with fewer calls, instead of copying it through the stream buffer.
+int stream_read_v(stream_t *s, struct stream_iovec *iov, int num_iov)
+{
+    int total = 0;
+    int n = 0;
+    int done = 0; // bytes already read into iov[n]
+    while (n < num_iov) {
+        if (done == iov[n].len) {
+            n++;
+            done = 0;
+            continue;
+        }
+        int r = 0;
+        if (s->buf_pos == s->buf_len && s->fill_buffer_v && !s->sector_size)
+            r = stream_read_unbuffered_v(s, iov + n, num_iov - n, done);
+        if (r > 0) {
+            total += r;
+            while (r > 0) {
+                int len = MPMIN(iov[n].len - done, r);
+                done += len;
+                r -= len;
+                if (done == iov[n].len) {
+                    n++;
+                    done = 0;
+                }
+            }
+            continue;
+        }
+        // Buffered data, or fallback for streams without fill_buffer_v.
+        r = stream_read_partial(s, (char *)iov[n].data + done,
+                                iov[n].len - done);
+        if (r <= 0)
+            break;
+        done += r;
+        total += r;
+    }
+    return total;
+}
+
 // Read ahead at most len bytes without changing the read position. Return a
 // pointer to the internal buffer, starting from the current read position.
 // Can read ahead at most STREAM_MAX_BUFFER_SIZE bytes.
@@ -423,6 +566,9 @@ struct bstr stream_peek(stream_t *s, int len)
 {
     assert(len >= 0);
     assert(len <= STREAM_MAX_BUFFER_SIZE);
+    unsigned char *data;
+    if (stream_get_mapped(s, &data) >= len)
+        return (bstr){.start = data, .len = len};
     if (s->buf_len - s->buf_pos < len) {
         // Move to front to guarantee we really can read up to max size.
         int buf_valid = s->buf_len - s->buf_pos;
@@ -447,6 +593,33 @@ struct bstr stream_peek(stream_t *s, int len)
                   .len = FFMIN(len, s->buf_len - s->buf_pos)};
 }
 
+// Return a pointer to between 1..len bytes of data starting at the current
+// read position, and skip them. This avoids copying the data if the stream
+// supports direct access to it (such as memory mapped files), and otherwise
+// returns a pointer into the internal buffer. Like stream_read_partial(), it
+// can return less data than requested even if EOF is not reached.
+// The returned data becomes invalid on the next stream call, and you must
+// not write to it. Return 0 on EOF, error, or if len was 0.
+int stream_borrow(stream_t *s, int len, unsigned char **data)
+{
+    assert(len >= 0);
+    if (!len)
+        return 0;
+    int avail = stream_get_mapped(s, data);
+    if (avail > 0) {
+        avail = MPMIN(avail, len);
+        stream_skip_mapped(s, avail);
+        return avail;
+    }
+    if (s->buf_pos == s->buf_len && !stream_fill_buffer_by(s, len))
+        return 0;
+    avail = MPMIN(len, s->buf_len - s->buf_pos);
+    *data = &s->buffer[s->buf_pos];
+    s->buf_pos += avail;
+    s->eof = 0;
+    return avail;
+}
+
 int stream_write_buffer(stream_t *s, unsigned char *buf, int len)
 {
     int rd;
@@ -501,7 +674,16 @@ static bool stream_seek_unbuffered(stream_t *s, int64_t newpos)
             MP_ERR(s, "Cannot seek backward in linear streams!\n");
             return false;
         }
-        if (s->seek(s, newpos) <= 0) {
+        struct stream_io_stats *st = &s->io_stats;
+        atomic_fetch_add(&st->seeks, 1);
+        if (newpos < s->pos)
+            atomic_fetch_add(&st->backward_seeks, 1);
+        int64_t start = mp_time_us();
+        int r = s->seek(s, newpos);
+        int64_t end = mp_time_us();
+        atomic_fetch_add(&st->seek_time, end - start);
+        MP_STATS(s, "range-timed %"PRId64" %"PRId64" seek", start, end);
+        if (r <= 0) {
             MP_ERR(s, "Seek failed\n");
             return false;
         }
@@ -536,6 +718,9 @@ bool stream_seek(stream_t *s, int64_t pos)
     if (s->mode == STREAM_WRITE)
         return s->seekable && s->seek(s, pos);
 
+    if (pos < s->pos && !s->seekable && stream_seek_mapped(s, pos))
+        return true;
+
     int64_t newpos = pos;
     if (s->sector_size)
         newpos = (pos / s->sector_size) * s->sector_size;
@@ -571,6 +756,7 @@ bool stream_skip(stream_t *s, int64_t len)
 
 int stream_control(stream_t *s, int cmd, void *arg)
 {
+    atomic_fetch_add(&s->io_stats.controls, 1);
     return s->control ? s->control(s, cmd, arg) : STREAM_UNSUPPORTED;
 }
 
@@ -588,6 +774,20 @@ void free_stream(stream_t *s)
     if (!s)
         return;
 
+    struct stream_io_stats *st = &s->io_stats;
+    int64_t reads = atomic_load(&st->reads);
+    if (reads) {
+        MP_VERBOSE(s, "%"PRId64" reads (%"PRId64" bytes, %.3f s), "
+                   "%"PRId64" seeks (%"PRId64" backward, %.3f s), "
+                   "%"PRId64" controls\n", reads,
+                   (int64_t)atomic_load(&st->read_bytes),
+                   atomic_load(&st->read_time) / 1e6,
+                   (int64_t)atomic_load(&st->seeks),
+                   (int64_t)atomic_load(&st->backward_seeks),
+                   atomic_load(&st->seek_time) / 1e6,
+                   (int64_t)atomic_load(&st->controls));
+    }
+
     if (s->close)
         s->close(s);
     free_stream(s->underlying);
@@ -27,6 +27,7 @@
 #include <fcntl.h>
 
 #include "misc/bstr.h"
+#include "osdep/atomic.h"
 
 #define STREAM_BUFFER_SIZE 2048
 #define STREAM_MAX_SECTOR_SIZE (8 * 1024)
@@ -136,6 +137,30 @@ struct stream_avseek {
     int flags;
 };
 
+// for stream_read_v() and stream.fill_buffer_v
+struct stream_iovec {
+    void *data;
+    int len;
+};
+
+// Number of buckets in stream_io_stats.read_sizes. Bucket n counts reads of
+// at most STREAM_READ_SIZE_LIMIT(n) bytes (the last bucket is unbounded).
+#define STREAM_READ_SIZE_BUCKETS 8
+#define STREAM_READ_SIZE_LIMIT(n) (512LL << (2 * (n)))
+
+// Calls into the stream implementation. Updated by the thread using the
+// stream, and can be read from any thread. Times are in microseconds.
+struct stream_io_stats {
+    mp_atomic_int64 reads;          // fill_buffer/fill_buffer_v calls
+    mp_atomic_int64 read_bytes;
+    mp_atomic_int64 read_time;
+    mp_atomic_int64 read_sizes[STREAM_READ_SIZE_BUCKETS];
+    mp_atomic_int64 seeks;
+    mp_atomic_int64 backward_seeks;
+    mp_atomic_int64 seek_time;
+    mp_atomic_int64 controls;
+};
+
 struct stream;
 typedef struct stream_info_st {
     const char *name;
@@ -152,6 +177,11 @@ typedef struct stream {
 
     // Read
     int (*fill_buffer)(struct stream *s, char *buffer, int max_len);
+    // Optional: like fill_buffer, but scatter the data over several buffers,
+    // filling them in order. Returns the total number of bytes read. If this
+    // returns 0, the generic code retries with fill_buffer.
+    int (*fill_buffer_v)(struct stream *s, struct stream_iovec *iov,
+                         int num_iov);
     // Write
     int (*write_buffer)(struct stream *s, char *buffer, int len);
     // Seek
@@ -162,6 +192,13 @@ typedef struct stream {
     int (*control)(struct stream *s, int cmd, void *arg);
     // Close
     void (*close)(struct stream *s);
+    // Optional: set *data to the file contents at pos, and return how many
+    // bytes are available there (0 if none). The data must stay valid until
+    // the next stream call. Streams implementing this must use s->pos as
+    // their read position, as it's advanced without calling fill_buffer.
+    // Non-seekable streams can be asked for data before s->pos (to seek back
+    // after stream_peek()), and return 0 if it's not accessible anymore.
+    int64_t (*get_mapped)(struct stream *s, int64_t pos, unsigned char **data);
 
     int sector_size; // sector size (seek will be aligned on this size if non 0)
     int read_chunk; // maximum amount of data to read at once to limit latency
@@ -191,6 +228,8 @@ typedef struct stream {
 
     struct stream *underlying;  // e.g. cache wrapper
 
+    struct stream_io_stats io_stats;
+
     // Includes additional padding in case sizes get rounded up by sector size.
     unsigned char buffer[];
 } stream_t;
@@ -233,7 +272,9 @@ bool stream_skip(stream_t *s, int64_t len);
 bool stream_seek(stream_t *s, int64_t pos);
 int stream_read(stream_t *s, char *mem, int total);
 int stream_read_partial(stream_t *s, char *buf, int buf_size);
+int stream_read_v(stream_t *s, struct stream_iovec *iov, int num_iov);
 struct bstr stream_peek(stream_t *s, int len);
+int stream_borrow(stream_t *s, int len, unsigned char **data);
 void stream_drop_buffers(stream_t *s);
 int64_t stream_get_size(stream_t *s);
 
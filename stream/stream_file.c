@@ -25,16 +25,25 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #ifndef __MINGW32__
 #include <poll.h>
 #endif
 
+#if HAVE_POSIX
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
 #include "osdep/io.h"
 
 #include "common/common.h"
 #include "common/msg.h"
+#include "misc/thread_pool.h"
 #include "stream.h"
+#include "options/m_config.h"
 #include "options/m_option.h"
 #include "options/path.h"
 
@@ -57,6 +66,21 @@
 #endif
 #endif
 
+struct stream_file_opts {
+    int mmap;
+    int readahead;
+};
+
+#define OPT_BASE_STRUCT struct stream_file_opts
+const struct m_sub_options stream_file_conf = {
+    .opts = (const m_option_t[]) {
+        OPT_FLAG("stream-file-mmap", mmap, 0),
+        OPT_INTRANGE("stream-file-readahead", readahead, 0, 0, 64),
+        {0}
+    },
+    .size = sizeof(struct stream_file_opts),
+};
+
 struct priv {
     int fd;
     bool close;
@@ -64,12 +88,43 @@ struct priv {
     bool regular_file;
     bool appending;
     int64_t orig_size;
+
+    // If the file is memory mapped, s->pos is the read position, and the
+    // file descriptor's position is unused.
+    unsigned char *map;
+    int64_t map_size;
+    int64_t advise_start, advise_end; // range passed to advise_readahead()
+
+    // Asynchronous read-ahead. If enabled, s->pos is the read position, and
+    // the file descriptor's position is only used by the fallback path.
+    struct mp_thread_pool *ra_pool;
+    struct readahead_block *ra_blocks;
+    int num_ra_blocks;
+    pthread_mutex_t ra_lock;
+    pthread_cond_t ra_wakeup;
+};
+
+// A file range read with pread() on a worker thread.
+struct readahead_block {
+    struct priv *p;
+    unsigned char *data;    // READAHEAD_BLOCK bytes
+    // --- protected by priv.ra_lock; the other fields can be changed only
+    //     while busy is false
+    int64_t pos;            // aligned file position, or -1 if unused
+    bool busy;              // pread() is queued or running
+    int64_t result;         // pread() return value
 };
 
 // Total timeout = RETRY_TIMEOUT * MAX_RETRIES
 #define RETRY_TIMEOUT 0.2
 #define MAX_RETRIES 10
 
+// Amount of data ahead of the read position the kernel is asked to prefetch.
+#define ADVISE_SIZE (4 * 1024 * 1024)
+
+#define READAHEAD_BLOCK (256 * 1024)
+#define READAHEAD_MAX_THREADS 4
+
 static int64_t get_size(stream_t *s)
 {
     struct priv *p = s->priv;
@@ -78,10 +133,189 @@ static int64_t get_size(stream_t *s)
     return size == (off_t)-1 ? -1 : size;
 }
 
+// Tell the kernel which part of the file is going to be read next. This is
+// redone when the read position leaves the first half of the advised range.
+static void advise_readahead(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    if (!p->regular_file)
+        return;
+    if (pos >= p->advise_start && pos < p->advise_end - ADVISE_SIZE / 2)
+        return;
+    int64_t end = pos + ADVISE_SIZE;
+#if HAVE_POSIX
+    if (p->map && pos < p->map_size) {
+        long page = sysconf(_SC_PAGESIZE);
+        int64_t start = pos / page * page;
+        end = MPMIN(end, p->map_size);
+        posix_madvise(p->map + start, end - start, POSIX_MADV_WILLNEED);
+    }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+    if (!p->map)
+        posix_fadvise(p->fd, pos, end - pos, POSIX_FADV_WILLNEED);
+#endif
+    p->advise_start = pos;
+    p->advise_end = end;
+}
+
+static int64_t get_mapped(stream_t *s, int64_t pos, unsigned char **data)
+{
+    struct priv *p = s->priv;
+    if (pos < 0 || pos >= p->map_size)
+        return 0;
+    advise_readahead(s, pos);
+    *data = p->map + pos;
+    return p->map_size - pos;
+}
+
+#if HAVE_POSIX
+static void readahead_run(void *ctx)
+{
+    struct readahead_block *b = ctx;
+    struct priv *p = b->p;
+
+    int64_t r = pread(p->fd, b->data, READAHEAD_BLOCK, b->pos);
+
+    pthread_mutex_lock(&p->ra_lock);
+    b->result = r;
+    b->busy = false;
+    pthread_cond_broadcast(&p->ra_wakeup);
+    pthread_mutex_unlock(&p->ra_lock);
+}
+
+static struct readahead_block *find_block(struct priv *p, int64_t pos)
+{
+    for (int n = 0; n < p->num_ra_blocks; n++) {
+        struct readahead_block *b = &p->ra_blocks[n];
+        if (b->pos >= 0 && pos >= b->pos && pos < b->pos + READAHEAD_BLOCK)
+            return b;
+    }
+    return NULL;
+}
+
+// Queue reads for all blocks in the window starting at pos, reusing blocks
+// outside of it. Blocks past the initial file size are not requested, except
+// the first one, which lets reads at the end of file fail normally.
+// Must be called with ra_lock held.
+static void queue_readahead(struct priv *p, int64_t pos)
+{
+    int64_t start = pos / READAHEAD_BLOCK * READAHEAD_BLOCK;
+    int64_t end = start + p->num_ra_blocks * (int64_t)READAHEAD_BLOCK;
+    for (int64_t bpos = start; bpos < end; bpos += READAHEAD_BLOCK) {
+        if (bpos > start && bpos >= p->orig_size)
+            break;
+        if (find_block(p, bpos))
+            continue;
+        struct readahead_block *b = NULL;
+        for (int n = 0; n < p->num_ra_blocks; n++) {
+            struct readahead_block *cur = &p->ra_blocks[n];
+            if (!cur->busy && (cur->pos < start || cur->pos >= end)) {
+                b = cur;
+                break;
+            }
+        }
+        if (!b)
+            break; // all blocks still in use by older reads
+        b->pos = bpos;
+        b->busy = true;
+        b->result = 0;
+        mp_thread_pool_queue(p->ra_pool, readahead_run, b);
+    }
+}
+
+// Return data from the read-ahead blocks, waiting for the block covering the
+// current position if necessary. Returns -1 if the normal read path should be
+// used instead (end of file, read errors).
+static int read_readahead(stream_t *s, char *buffer, int max_len)
+{
+    struct priv *p = s->priv;
+    int r = -1;
+
+    pthread_mutex_lock(&p->ra_lock);
+    queue_readahead(p, s->pos);
+    struct readahead_block *b = find_block(p, s->pos);
+    if (b) {
+        while (b->busy)
+            pthread_cond_wait(&p->ra_wakeup, &p->ra_lock);
+        int64_t avail = b->result - (s->pos - b->pos);
+        if (avail > 0) {
+            r = MPMIN(max_len, avail);
+            memcpy(buffer, b->data + (s->pos - b->pos), r);
+        } else {
+            // Possibly a short read at the old end of a growing file.
+            b->pos = -1;
+        }
+    }
+    pthread_mutex_unlock(&p->ra_lock);
+
+    if (r < 0)
+        lseek(p->fd, s->pos, SEEK_SET);
+    return r;
+}
+
+static void init_readahead(stream_t *s, int num_blocks)
+{
+    struct priv *p = s->priv;
+    p->ra_pool = mp_thread_pool_create(p, MPMIN(num_blocks,
+                                                READAHEAD_MAX_THREADS));
+    if (!p->ra_pool) {
+        MP_WARN(s, "Could not create read-ahead threads.\n");
+        return;
+    }
+    pthread_mutex_init(&p->ra_lock, NULL);
+    pthread_cond_init(&p->ra_wakeup, NULL);
+    p->ra_blocks = talloc_zero_array(p, struct readahead_block, num_blocks);
+    p->num_ra_blocks = num_blocks;
+    for (int n = 0; n < num_blocks; n++) {
+        p->ra_blocks[n] = (struct readahead_block){
+            .p = p,
+            .data = talloc_size(p->ra_blocks, READAHEAD_BLOCK),
+            .pos = -1,
+        };
+    }
+    MP_VERBOSE(s, "Using %d read-ahead blocks.\n", num_blocks);
+}
+
+static void uninit_readahead(stream_t *s)
+{
+    struct priv *p = s->priv;
+    if (!p->ra_pool)
+        return;
+    talloc_free(p->ra_pool); // waits for pending reads
+    p->ra_pool = NULL;
+    pthread_cond_destroy(&p->ra_wakeup);
+    pthread_mutex_destroy(&p->ra_lock);
+}
+#endif
+
 static int fill_buffer(stream_t *s, char *buffer, int max_len)
 {
     struct priv *p = s->priv;
 
+#if HAVE_POSIX
+    if (p->ra_pool) {
+        int r = read_readahead(s, buffer, max_len);
+        if (r >= 0)
+            return r;
+    }
+#endif
+
+    if (p->map) {
+        unsigned char *data;
+        int64_t avail = get_mapped(s, s->pos, &data);
+        if (avail > 0) {
+            int len = MPMIN(max_len, avail);
+            memcpy(buffer, data, len);
+            return len;
+        }
+        // Data appended after the file was mapped is read normally.
+        if (lseek(p->fd, s->pos, SEEK_SET) == (off_t)-1)
+            return -1;
+    } else if (!p->ra_pool) {
+        advise_readahead(s, s->pos);
+    }
+
 #ifndef __MINGW32__
     if (p->use_poll) {
         int c = s->cancel ? mp_cancel_get_fd(s->cancel) : -1;
@@ -118,6 +352,40 @@ static int fill_buffer(stream_t *s, char *buffer, int max_len)
     return 0;
 }
 
+#if HAVE_POSIX
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 64
+#endif
+
+static int fill_buffer_v(stream_t *s, struct stream_iovec *iov, int num_iov)
+{
+    struct priv *p = s->priv;
+
+    if (p->map) {
+        unsigned char *data;
+        int64_t avail = get_mapped(s, s->pos, &data);
+        int64_t total = 0;
+        for (int n = 0; n < num_iov && total < avail; n++) {
+            int len = MPMIN(iov[n].len, avail - total);
+            memcpy(iov[n].data, data + total, len);
+            total += len;
+        }
+        return total;
+    }
+
+    advise_readahead(s, s->pos);
+
+    struct iovec vec[MAX_IOV];
+    int num = MPMIN(num_iov, MP_ARRAY_SIZE(vec));
+    for (int n = 0; n < num; n++)
+        vec[n] = (struct iovec){.iov_base = iov[n].data, .iov_len = iov[n].len};
+    ssize_t r = readv(p->fd, vec, num);
+    return MPMAX(r, 0);
+}
+#endif
+
 static int write_buffer(stream_t *s, char *buffer, int len)
 {
     struct priv *p = s->priv;
@@ -136,6 +404,8 @@ static int write_buffer(stream_t *s, char *buffer, int len)
 static int seek(stream_t *s, int64_t newpos)
 {
     struct priv *p = s->priv;
+    if (p->map)
+        return 1;
     return lseek(p->fd, newpos, SEEK_SET) != (off_t)-1;
 }
 
@@ -157,6 +427,11 @@ static int control(stream_t *s, int cmd, void *arg)
 static void s_close(stream_t *s)
 {
     struct priv *p = s->priv;
+#if HAVE_POSIX
+    uninit_readahead(s);
+    if (p->map)
+        munmap(p->map, p->map_size);
+#endif
     if (p->close)
         close(p->fd);
 }
@@ -360,6 +635,35 @@ static int open_f(stream_t *stream)
 
     p->orig_size = get_size(stream);
 
+#if HAVE_POSIX
+    struct stream_file_opts *opts =
+        mp_get_config_group(stream, stream->global, &stream_file_conf);
+    if (opts->mmap && !write && p->regular_file && stream->seekable &&
+        p->orig_size > 0 && p->orig_size <= SIZE_MAX)
+    {
+        void *map = mmap(NULL, p->orig_size, PROT_READ, MAP_SHARED, p->fd, 0);
+        if (map != MAP_FAILED) {
+            p->map = map;
+            p->map_size = p->orig_size;
+            stream->get_mapped = get_mapped;
+            posix_madvise(p->map, p->map_size, POSIX_MADV_SEQUENTIAL);
+            MP_VERBOSE(stream, "File is memory mapped.\n");
+        } else {
+            MP_WARN(stream, "Could not mmap file: %s\n", mp_strerror(errno));
+        }
+    }
+    if (opts->readahead && !write && p->regular_file && stream->seekable &&
+        !p->map)
+        init_readahead(stream, opts->readahead);
+    // The read-ahead blocks and polling are only done by fill_buffer.
+    if (!p->ra_pool && !p->use_poll)
+        stream->fill_buffer_v = fill_buffer_v;
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (!p->map && !p->ra_pool && p->regular_file)
+        posix_fadvise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
     return STREAM_OK;
 }
 
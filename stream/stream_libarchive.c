@@ -18,8 +18,11 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <libavutil/intreadwrite.h>
+
 #include "misc/bstr.h"
 #include "common/common.h"
+#include "common/msg.h"
 #include "stream.h"
 
 #include "stream_libarchive.h"
@@ -234,6 +237,8 @@ static bool add_volume(struct mp_log *log, struct mp_archive *mpa,
     locale_t oldlocale = uselocale(mpa->locale);
     bool res = archive_read_append_callback_data(mpa->arch, vol) == ARCHIVE_OK;
     uselocale(oldlocale);
+    if (res)
+        mpa->num_volumes += 1;
     return res;
 }
 
@@ -345,46 +350,220 @@ bool mp_archive_next_entry(struct mp_archive *mpa)
     return success;
 }
 
+// Maximum number of parked readers kept as seek checkpoints.
+#define MAX_CHECKPOINTS 4
+
+// Distance the trailing reader keeps behind the current read position.
+#define TRAIL_DISTANCE (4 * 1024 * 1024)
+
+// An archive reader (with its own source stream) parked at an entry position.
+struct checkpoint {
+    struct mp_archive *mpa;
+    struct stream *src;
+    int64_t pos;
+};
+
 struct priv {
     struct mp_archive *mpa;
     bool broken_seek;
     struct stream *src;
+    char *src_url;
     int64_t entry_size;
     char *entry_name;
+    // File offset of the data of a stored (uncompressed) entry in src, or -1.
+    // If set, the data is read from src directly, bypassing libarchive.
+    int64_t stored_offset;
+    struct checkpoint checkpoints[MAX_CHECKPOINTS];
+    int num_checkpoints;
+    // Second reader following the current one at about TRAIL_DISTANCE bytes,
+    // so that short backward seeks need not decompress from the start. Only
+    // used after the first backward seek, as it doubles the decompression
+    // work (and the reads from src).
+    struct checkpoint trailing;
+    bool want_trailing;
+    bool trailing_failed;
+    bool native_seek;       // archive_seek_data() worked
 };
 
+static void free_checkpoint(struct checkpoint *cp)
+{
+    mp_archive_free(cp->mpa);
+    free_stream(cp->src);
+    *cp = (struct checkpoint){0};
+}
+
+// Open a new archive reader on src, positioned at the start of the entry.
+static struct mp_archive *open_entry(stream_t *s, struct stream *src)
+{
+    struct priv *p = s->priv;
+    struct mp_archive *mpa = mp_archive_new(s->log, src, MP_ARCHIVE_FLAG_UNSAFE);
+    if (!mpa)
+        return NULL;
+
+    // Follows the same logic as demux_libarchive.c.
+    while (mp_archive_next_entry(mpa)) {
+        if (strcmp(p->entry_name, mpa->entry_filename) == 0)
+            return mpa;
+    }
+
+    mp_archive_free(mpa);
+    MP_ERR(s, "archive entry not found. '%s'\n", p->entry_name);
+    return NULL;
+}
+
 static int reopen_archive(stream_t *s)
 {
     struct priv *p = s->priv;
     mp_archive_free(p->mpa);
-    p->mpa = mp_archive_new(s->log, p->src, MP_ARCHIVE_FLAG_UNSAFE);
+    p->mpa = open_entry(s, p->src);
     if (!p->mpa)
         return STREAM_ERROR;
 
-    // Follows the same logic as demux_libarchive.c.
+    locale_t oldlocale = uselocale(p->mpa->locale);
+    p->entry_size = -1;
+    if (archive_entry_size_is_set(p->mpa->entry))
+        p->entry_size = archive_entry_size(p->mpa->entry);
+    uselocale(oldlocale);
+    return STREAM_OK;
+}
+
+// Check whether the current entry is stored uncompressed in a single-volume
+// zip file. If so, set p->stored_offset to the position of its data.
+static void find_stored_offset(stream_t *s)
+{
+    struct priv *p = s->priv;
     struct mp_archive *mpa = p->mpa;
-    while (mp_archive_next_entry(mpa)) {
-        if (strcmp(p->entry_name, mpa->entry_filename) == 0) {
-            locale_t oldlocale = uselocale(mpa->locale);
-            p->entry_size = -1;
-            if (archive_entry_size_is_set(mpa->entry))
-                p->entry_size = archive_entry_size(mpa->entry);
-            uselocale(oldlocale);
-            return STREAM_OK;
+    p->stored_offset = -1;
+
+    if (mpa->num_volumes != 1 || !p->src->seekable || p->entry_size < 0)
+        return;
+    if ((archive_format(mpa->arch) & ARCHIVE_FORMAT_BASE_MASK) !=
+        ARCHIVE_FORMAT_ZIP)
+        return;
+
+    // Check the local file header, which must precede the entry data.
+    int64_t header_pos = archive_read_header_position(mpa->arch);
+    uint8_t h[30];
+    int64_t old_pos = stream_tell(p->src);
+    bool ok = header_pos >= 0 && stream_seek(p->src, header_pos) &&
+              stream_read(p->src, h, sizeof(h)) == sizeof(h);
+    stream_seek(p->src, old_pos);
+    if (!ok || AV_RL32(h) != 0x04034b50)
+        return;
+    unsigned flags = AV_RL16(h + 6);
+    unsigned method = AV_RL16(h + 8);
+    uint32_t csize = AV_RL32(h + 18);
+    uint32_t usize = AV_RL32(h + 22);
+    // Reject encryption, data descriptors (sizes unknown in this header), and
+    // zip64 entries (sizes in extra fields).
+    if ((flags & (1 | 8)) || method != 0 || csize != usize ||
+        csize != p->entry_size)
+        return;
+
+    p->stored_offset = header_pos + 30 + AV_RL16(h + 26) + AV_RL16(h + 28);
+    MP_VERBOSE(s, "entry is stored, reading it directly\n");
+
+    // The libarchive reader is not needed anymore.
+    mp_archive_free(p->mpa);
+    p->mpa = NULL;
+}
+
+// Add a parked reader to the checkpoints. If there are too many, drop the
+// checkpoint closest to the start; it's the cheapest to redo.
+static void add_checkpoint(stream_t *s, struct checkpoint cp)
+{
+    struct priv *p = s->priv;
+    if (p->num_checkpoints == MAX_CHECKPOINTS) {
+        int drop = 0;
+        for (int n = 1; n < p->num_checkpoints; n++) {
+            if (p->checkpoints[n].pos < p->checkpoints[drop].pos)
+                drop = n;
         }
+        free_checkpoint(&p->checkpoints[drop]);
+        MP_TARRAY_REMOVE_AT(p->checkpoints, p->num_checkpoints, drop);
     }
+    p->checkpoints[p->num_checkpoints++] = cp;
+}
 
-    mp_archive_free(p->mpa);
-    p->mpa = NULL;
-    MP_ERR(s, "archive entry not found. '%s'\n", p->entry_name);
-    return STREAM_ERROR;
+// Return the index of the checkpoint closest before or at pos, or -1.
+static int find_checkpoint(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    int best = -1;
+    for (int n = 0; n < p->num_checkpoints; n++) {
+        int64_t cp_pos = p->checkpoints[n].pos;
+        if (cp_pos <= pos && (best < 0 || cp_pos > p->checkpoints[best].pos))
+            best = n;
+    }
+    return best;
+}
+
+static struct checkpoint take_checkpoint(stream_t *s, int index)
+{
+    struct priv *p = s->priv;
+    struct checkpoint cp = p->checkpoints[index];
+    MP_TARRAY_REMOVE_AT(p->checkpoints, p->num_checkpoints, index);
+    return cp;
+}
+
+// Move the trailing reader towards TRAIL_DISTANCE bytes behind the current
+// position. It advances by at most len + 4 KiB per call, so that the extra
+// decompression is spread over all reads instead of stalling a single one.
+static void advance_trailing(stream_t *s, int len)
+{
+    struct priv *p = s->priv;
+    struct checkpoint *t = &p->trailing;
+    if (!p->want_trailing || p->native_seek || p->trailing_failed)
+        return;
+
+    char buffer[4096];
+    int64_t left = len + sizeof(buffer);
+    while (left > 0 && s->pos - t->pos > TRAIL_DISTANCE) {
+        if (!t->mpa) {
+            int n = find_checkpoint(s, s->pos - TRAIL_DISTANCE);
+            if (n >= 0) {
+                *t = take_checkpoint(s, n);
+                continue;
+            }
+            t->src = stream_create(p->src_url, STREAM_READ | STREAM_SAFE_ONLY,
+                                   s->cancel, s->global);
+            t->mpa = t->src ? open_entry(s, t->src) : NULL;
+            t->pos = 0;
+            if (!t->mpa)
+                goto fail;
+        }
+        int size = MPMIN(MPMIN(s->pos - TRAIL_DISTANCE - t->pos, left),
+                         sizeof(buffer));
+        locale_t oldlocale = uselocale(t->mpa->locale);
+        int r = archive_read_data(t->mpa->arch, buffer, size);
+        uselocale(oldlocale);
+        if (r <= 0)
+            goto fail;
+        t->pos += r;
+        left -= r;
+    }
+    return;
+
+fail:
+    MP_WARN(s, "disabling trailing reader\n");
+    free_checkpoint(t);
+    p->trailing_failed = true;
 }
 
 static int archive_entry_fill_buffer(stream_t *s, char *buffer, int max_len)
 {
     struct priv *p = s->priv;
+    if (p->stored_offset >= 0) {
+        int64_t left = p->entry_size - s->pos;
+        if (left <= 0)
+            return 0;
+        if (!stream_seek(p->src, p->stored_offset + s->pos))
+            return -1;
+        return stream_read_partial(p->src, buffer, MPMIN(max_len, left));
+    }
     if (!p->mpa)
         return 0;
+    advance_trailing(s, max_len);
     locale_t oldlocale = uselocale(p->mpa->locale);
     int r = archive_read_data(p->mpa->arch, buffer, max_len);
     if (r < 0) {
@@ -398,29 +577,105 @@ static int archive_entry_fill_buffer(stream_t *s, char *buffer, int max_len)
     return r;
 }
 
+// Keep the current reader at its position, so that a later seek can resume
+// from there instead of decompressing the entry from the start.
+static void park_reader(stream_t *s)
+{
+    struct priv *p = s->priv;
+    if (!p->mpa || !p->mpa->arch || s->pos <= 0) {
+        mp_archive_free(p->mpa);
+        free_stream(p->src);
+    } else {
+        add_checkpoint(s, (struct checkpoint){
+            .mpa = p->mpa,
+            .src = p->src,
+            .pos = s->pos,
+        });
+    }
+    p->mpa = NULL;
+    p->src = NULL;
+}
+
+// Switch to the reader that can reach newpos with the least decompression:
+// the trailing reader or checkpoint closest before newpos, the current reader,
+// or a new reader. Return false if a new reader could not be opened.
+static bool switch_reader(stream_t *s, int64_t newpos)
+{
+    struct priv *p = s->priv;
+    struct checkpoint *t = &p->trailing;
+    int best = find_checkpoint(s, newpos);
+    int64_t best_pos = best >= 0 ? p->checkpoints[best].pos : -1;
+    bool use_trailing = t->mpa && t->pos <= newpos && t->pos > best_pos;
+    if (use_trailing)
+        best_pos = t->pos;
+    bool use_current = p->mpa && newpos >= s->pos && best_pos <= s->pos;
+    if (use_current)
+        return true;
+
+    // Take the new reader out before parking the current one, which might
+    // evict it from the checkpoints otherwise.
+    struct checkpoint cp = {0};
+    if (use_trailing) {
+        cp = *t;
+        *t = (struct checkpoint){0};
+    } else if (best >= 0) {
+        cp = take_checkpoint(s, best);
+    }
+
+    park_reader(s);
+
+    if (cp.mpa) {
+        MP_VERBOSE(s, "resuming from %s at %"PRId64"\n",
+                   use_trailing ? "trailing reader" : "checkpoint", cp.pos);
+        p->mpa = cp.mpa;
+        p->src = cp.src;
+        s->pos = cp.pos;
+    } else {
+        // Hack seeking backwards into working by reopening the archive and
+        // starting over.
+        MP_VERBOSE(s, "trying to reopen archive for performing seek\n");
+        p->src = stream_create(p->src_url, STREAM_READ | STREAM_SAFE_ONLY,
+                               s->cancel, s->global);
+        if (!p->src || reopen_archive(s) < STREAM_OK)
+            return false;
+        s->pos = 0;
+    }
+
+    // A trailing reader ahead of the new position is still a good checkpoint.
+    if (t->mpa && t->pos > s->pos) {
+        add_checkpoint(s, *t);
+        *t = (struct checkpoint){0};
+    }
+    return true;
+}
+
 static int archive_entry_seek(stream_t *s, int64_t newpos)
 {
     struct priv *p = s->priv;
+    if (p->stored_offset >= 0)
+        return 1;
+    // Don't fetch network sources twice for the trailing reader.
+    if (newpos < s->pos && p->src && !p->src->is_network)
+        p->want_trailing = true;
     if (p->mpa && !p->broken_seek) {
         locale_t oldlocale = uselocale(p->mpa->locale);
         int r = archive_seek_data(p->mpa->arch, newpos, SEEK_SET);
         uselocale(oldlocale);
-        if (r >= 0)
+        if (r >= 0) {
+            // Seeking works natively, so the trailing reader is not needed.
+            p->native_seek = true;
+            free_checkpoint(&p->trailing);
             return 1;
+        }
         MP_WARN(s, "possibly unsupported seeking - switching to reopening\n");
         p->broken_seek = true;
         if (reopen_archive(s) < STREAM_OK)
             return -1;
-    }
-    // libarchive can't seek in most formats.
-    if (newpos < s->pos) {
-        // Hack seeking backwards into working by reopening the archive and
-        // starting over.
-        MP_VERBOSE(s, "trying to reopen archive for performing seek\n");
-        if (reopen_archive(s) < STREAM_OK)
-            return -1;
         s->pos = 0;
     }
+    // libarchive can't seek in most formats.
+    if (!switch_reader(s, newpos))
+        return -1;
     if (newpos > s->pos) {
         // For seeking forwards, just keep reading data (there's no libarchive
         // skip function either).
@@ -458,6 +713,10 @@ static int archive_entry_seek(stream_t *s, int64_t newpos)
 static void archive_entry_close(stream_t *s)
 {
     struct priv *p = s->priv;
+    for (int n = 0; n < p->num_checkpoints; n++)
+        free_checkpoint(&p->checkpoints[n]);
+    p->num_checkpoints = 0;
+    free_checkpoint(&p->trailing);
     mp_archive_free(p->mpa);
     free_stream(p->src);
 }
@@ -467,7 +726,7 @@ static int archive_entry_control(stream_t *s, int cmd, void *arg)
     struct priv *p = s->priv;
     switch (cmd) {
     case STREAM_CTRL_GET_BASE_FILENAME:
-        *(char **)arg = talloc_strdup(NULL, p->src->url);
+        *(char **)arg = talloc_strdup(NULL, p->src_url);
         return STREAM_OK;
     case STREAM_CTRL_GET_SIZE:
         if (p->entry_size < 0)
@@ -491,6 +750,8 @@ static int archive_entry_open(stream_t *stream)
     *name++ = '\0';
     p->entry_name = name;
     mp_url_unescape_inplace(base);
+    p->src_url = base;
+    p->stored_offset = -1;
 
     p->src = stream_create(base, STREAM_READ | STREAM_SAFE_ONLY,
                            stream->cancel, stream->global);
@@ -505,6 +766,8 @@ static int archive_entry_open(stream_t *stream)
         return r;
     }
 
+    find_stored_offset(stream);
+
     stream->fill_buffer = archive_entry_fill_buffer;
     if (p->src->seekable) {
         stream->seek = archive_entry_seek;
@@ -34,6 +34,21 @@ static int fill_buffer(stream_t *s, char* buffer, int len)
     return len;
 }
 
+static int fill_buffer_v(stream_t *s, struct stream_iovec *iov, int num_iov)
+{
+    struct priv *p = s->priv;
+    bstr data = p->data;
+    if (s->pos < 0 || s->pos > data.len)
+        return 0;
+    int64_t pos = s->pos;
+    for (int n = 0; n < num_iov; n++) {
+        int len = FFMIN(iov[n].len, data.len - pos);
+        memcpy(iov[n].data, data.start + pos, len);
+        pos += len;
+    }
+    return pos - s->pos;
+}
+
 static int seek(stream_t *s, int64_t newpos)
 {
     return 1;
@@ -58,6 +73,7 @@ static int control(stream_t *s, int cmd, void *arg)
 static int open_f(stream_t *stream)
 {
     stream->fill_buffer = fill_buffer;
+    stream->fill_buffer_v = fill_buffer_v;
     stream->seek = seek;
     stream->seekable = true;
     stream->control = control;
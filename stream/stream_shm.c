@@ -0,0 +1,295 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#include "common/common.h"
+#include "common/msg.h"
+#include "stream.h"
+
+#define SHM_MAGIC "mpvring1"
+
+// Layout of the start of the shared memory object. The producer creates the
+// object, initializes this header, and appends data to the ring. The data
+// area starts at header_size and is data_size bytes large; both must be
+// multiples of the page size. Positions are absolute byte counts since the
+// producer started writing, so the ring offset of a position is
+// (pos % data_size).
+//
+// The producer only ever writes to data in [read_pos, read_pos + data_size),
+// and mpv only reads data in [read_pos, write_pos).
+struct shm_ring {
+    char magic[8];                      // SHM_MAGIC
+    uint32_t header_size;
+    uint32_t flags;                     // reserved, must be 0
+    uint64_t data_size;
+    // Written by the producer.
+    _Atomic uint64_t write_pos;         // end of the written data
+    _Atomic uint32_t write_seq;         // futex, incremented on write_pos/eof
+    _Atomic uint32_t eof;               // set to 1 when no more data follows
+    _Atomic uint32_t producer_waiting;  // set while waiting on read_seq
+    // Written by mpv.
+    _Atomic uint32_t consumer_waiting;  // set while waiting on write_seq
+    _Atomic uint32_t read_seq;          // futex, incremented on read_pos
+    uint32_t pad;
+    _Atomic uint64_t read_pos;          // start of the unconsumed data
+};
+
+// Without futexes, waiting for the producer is done by polling.
+#define POLL_TIME 0.005
+// How long to block before checking for cancellation.
+#define WAIT_TIME_MS 100
+
+struct priv {
+    struct shm_ring *ring;
+    size_t header_size;
+    // The data area is mapped twice in a row, so that data wrapping around
+    // the end of the ring can be accessed as one contiguous range.
+    unsigned char *data;
+    size_t data_size;
+    int64_t offset;                     // ring position of stream pos 0
+    int64_t back_size;                  // data kept before the read position
+};
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val)
+{
+#ifdef __linux__
+    struct timespec ts = {
+        .tv_sec = WAIT_TIME_MS / 1000,
+        .tv_nsec = (WAIT_TIME_MS % 1000) * 1000000L,
+    };
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#endif
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// Mark everything up to back_size bytes before the given stream position as
+// consumed, so the producer can overwrite it. The rest is kept for seeking
+// back, which demuxers do after stream_peek().
+static void release(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    struct shm_ring *ring = p->ring;
+    if (pos <= p->back_size)
+        return;
+    uint64_t ring_pos = pos - p->back_size + p->offset;
+    if (ring_pos <= atomic_load(&ring->read_pos))
+        return;
+    atomic_store(&ring->read_pos, ring_pos);
+    atomic_fetch_add(&ring->read_seq, 1);
+    if (atomic_load(&ring->producer_waiting))
+        futex_wake(&ring->read_seq);
+}
+
+// Return how many bytes can be read at pos without waiting.
+static int64_t get_avail(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    uint64_t write_pos = atomic_load(&p->ring->write_pos);
+    uint64_t ring_pos = pos + p->offset;
+    if (write_pos <= ring_pos)
+        return 0;
+    return MPMIN(write_pos - ring_pos, p->data_size);
+}
+
+static unsigned char *get_data(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    return p->data + (uint64_t)(pos + p->offset) % p->data_size;
+}
+
+// The caller is done with all data before pos (mapped data only needs to stay
+// valid until the next stream call), so it can be handed back to the producer.
+// pos is before the read position on backward seeks.
+static int64_t get_mapped(stream_t *s, int64_t pos, unsigned char **data)
+{
+    struct priv *p = s->priv;
+    if (pos + p->offset < atomic_load(&p->ring->read_pos))
+        return 0;
+    release(s, pos);
+    *data = get_data(s, pos);
+    return get_avail(s, pos);
+}
+
+// Wait until data at pos is available, the producer signals EOF, or the
+// stream is cancelled. Return the number of available bytes, or 0 on EOF.
+static int64_t wait_data(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    struct shm_ring *ring = p->ring;
+    while (1) {
+        uint32_t seq = atomic_load(&ring->write_seq);
+        atomic_store(&ring->consumer_waiting, 1);
+        int64_t avail = get_avail(s, pos);
+        if (avail || atomic_load(&ring->eof) || mp_cancel_test(s->cancel)) {
+            atomic_store(&ring->consumer_waiting, 0);
+            // Data might have been added before EOF was set.
+            return avail ? avail : get_avail(s, pos);
+        }
+#ifdef __linux__
+        futex_wait(&ring->write_seq, seq);
+#else
+        mp_cancel_wait(s->cancel, POLL_TIME);
+#endif
+    }
+}
+
+static int fill_buffer(stream_t *s, char *buffer, int max_len)
+{
+    int64_t avail = wait_data(s, s->pos);
+    int len = MPMIN(max_len, avail);
+    memcpy(buffer, get_data(s, s->pos), len);
+    release(s, s->pos + len);
+    return len;
+}
+
+static int control(stream_t *s, int cmd, void *arg)
+{
+    return STREAM_UNSUPPORTED;
+}
+
+static void s_close(stream_t *s)
+{
+    struct priv *p = s->priv;
+    if (p->data)
+        munmap(p->data, p->data_size * 2);
+    if (p->ring)
+        munmap(p->ring, p->header_size);
+}
+
+static bool map_data(stream_t *s, int fd)
+{
+    struct priv *p = s->priv;
+    void *base = mmap(NULL, p->data_size * 2, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+    p->data = base;
+    for (int n = 0; n < 2; n++) {
+        void *addr = p->data + n * p->data_size;
+        if (mmap(addr, p->data_size, PROT_READ, MAP_SHARED | MAP_FIXED,
+                 fd, p->header_size) == MAP_FAILED)
+            return false;
+    }
+    return true;
+}
+
+static int open_f(stream_t *stream)
+{
+    struct priv *p = talloc_zero(stream, struct priv);
+    stream->priv = p;
+
+    if (stream->mode != STREAM_READ)
+        return STREAM_UNSUPPORTED;
+
+    char *name = stream->path;
+    if (name[0] != '/')
+        name = talloc_asprintf(stream, "/%s", name);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        MP_ERR(stream, "Cannot open shared memory '%s': %s\n", name,
+               mp_strerror(errno));
+        return STREAM_ERROR;
+    }
+
+    int r = STREAM_ERROR;
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    struct shm_ring hdr;
+    if (fstat(fd, &st) || st.st_size < sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    {
+        MP_ERR(stream, "Cannot read shared memory header.\n");
+        goto done;
+    }
+    if (memcmp(hdr.magic, SHM_MAGIC, sizeof(hdr.magic)) != 0 || hdr.flags ||
+        hdr.header_size < sizeof(hdr) || hdr.header_size % page_size ||
+        !hdr.data_size || hdr.data_size % page_size ||
+        hdr.data_size > SIZE_MAX / 2 ||
+        st.st_size < (uint64_t)hdr.header_size + hdr.data_size)
+    {
+        MP_ERR(stream, "Invalid shared memory header.\n");
+        goto done;
+    }
+
+    p->header_size = hdr.header_size;
+    p->data_size = hdr.data_size;
+    p->ring = mmap(NULL, p->header_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    if (p->ring == MAP_FAILED) {
+        p->ring = NULL;
+        MP_ERR(stream, "Cannot map shared memory: %s\n", mp_strerror(errno));
+        goto done;
+    }
+    if (!atomic_is_lock_free(&p->ring->write_pos)) {
+        MP_ERR(stream, "Shared memory requires lock-free atomics.\n");
+        goto done;
+    }
+    if (!map_data(stream, fd)) {
+        MP_ERR(stream, "Cannot map shared memory: %s\n", mp_strerror(errno));
+        goto done;
+    }
+
+    p->offset = atomic_load(&p->ring->read_pos);
+    p->back_size = MPMIN(p->data_size / 2, STREAM_MAX_BUFFER_SIZE);
+
+    stream->fill_buffer = fill_buffer;
+    stream->get_mapped = get_mapped;
+    stream->control = control;
+    stream->close = s_close;
+    stream->fast_skip = true;
+    stream->streaming = true;
+    stream->read_chunk = MPMIN(p->data_size, 4 * 1024 * 1024);
+    // The ring buffer already decouples mpv from the producer.
+    stream->allow_caching = false;
+
+    MP_VERBOSE(stream, "Ring buffer of %zu bytes.\n", p->data_size);
+    r = STREAM_OK;
+
+done:
+    close(fd);
+    if (r != STREAM_OK)
+        s_close(stream);
+    return r;
+}
+
+const stream_info_t stream_info_shm = {
+    .name = "shm",
+    .open = open_f,
+    .protocols = (const char*const[]){ "shm", NULL },
+};
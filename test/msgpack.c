@@ -0,0 +1,232 @@
+#include "test_helpers.h"
+#include "common/common.h"
+#include "misc/msgpack.h"
+#include "ta/ta_talloc.h"
+
+#define NODE_INT(v) (struct mpv_node){.format = MPV_FORMAT_INT64, .u.int64 = (v)}
+#define NODE_STR(v) (struct mpv_node){.format = MPV_FORMAT_STRING, .u.string = (v)}
+
+static void assert_node_equal(struct mpv_node *a, struct mpv_node *b)
+{
+    assert_int_equal(a->format, b->format);
+    switch (a->format) {
+    case MPV_FORMAT_NONE:
+        break;
+    case MPV_FORMAT_FLAG:
+        assert_int_equal(a->u.flag, b->u.flag);
+        break;
+    case MPV_FORMAT_INT64:
+        assert_true(a->u.int64 == b->u.int64);
+        break;
+    case MPV_FORMAT_DOUBLE:
+        assert_true(a->u.double_ == b->u.double_);
+        break;
+    case MPV_FORMAT_STRING:
+        assert_string_equal(a->u.string, b->u.string);
+        break;
+    case MPV_FORMAT_BYTE_ARRAY:
+        assert_int_equal(a->u.ba->size, b->u.ba->size);
+        if (a->u.ba->size)
+            assert_memory_equal(a->u.ba->data, b->u.ba->data, a->u.ba->size);
+        break;
+    case MPV_FORMAT_NODE_ARRAY:
+    case MPV_FORMAT_NODE_MAP:
+        assert_int_equal(a->u.list->num, b->u.list->num);
+        for (int n = 0; n < a->u.list->num; n++) {
+            if (a->format == MPV_FORMAT_NODE_MAP)
+                assert_string_equal(a->u.list->keys[n], b->u.list->keys[n]);
+            assert_node_equal(&a->u.list->values[n], &b->u.list->values[n]);
+        }
+        break;
+    default:
+        fail();
+    }
+}
+
+// Encode src, check that the encoding starts with the given tag byte and has
+// the given size, and that decoding it returns the same node. Also check that
+// every truncated prefix of the encoding is rejected.
+static void test_roundtrip(struct mpv_node *src, int tag, size_t size)
+{
+    void *ta = talloc_new(NULL);
+
+    bstr data = {0};
+    assert_int_equal(msgpack_write(ta, &data, src), 0);
+    assert_int_equal(data.start[0], tag);
+    assert_int_equal(data.len, size);
+
+    struct mpv_node dst;
+    bstr rest = data;
+    assert_int_equal(msgpack_parse(ta, &dst, &rest, 10), 0);
+    assert_int_equal(rest.len, 0);
+    assert_node_equal(src, &dst);
+
+    for (size_t n = 0; n < data.len; n++) {
+        rest = (bstr){data.start, n};
+        assert_int_equal(msgpack_parse(ta, &dst, &rest, 10), -1);
+    }
+
+    talloc_free(ta);
+}
+
+static void test_parse_fail(const char *data, size_t size)
+{
+    void *ta = talloc_new(NULL);
+    struct mpv_node dst;
+    bstr src = {(unsigned char *)data, size};
+    assert_int_equal(msgpack_parse(ta, &dst, &src, 10), -1);
+    talloc_free(ta);
+}
+
+static void test_msgpack_scalars(void **state)
+{
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_NONE}, 0xc0, 1);
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_FLAG, .u.flag = 0},
+                   0xc2, 1);
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_FLAG, .u.flag = 1},
+                   0xc3, 1);
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_DOUBLE,
+                                      .u.double_ = -1.5}, 0xcb, 9);
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_DOUBLE,
+                                      .u.double_ = 1e300}, 0xcb, 9);
+}
+
+static void test_msgpack_ints(void **state)
+{
+    static const struct {
+        int64_t v;
+        int tag;
+        size_t size;
+    } ints[] = {
+        {0,                 0x00, 1},
+        {127,               0x7f, 1},
+        {128,               0xcc, 2},
+        {255,               0xcc, 2},
+        {256,               0xcd, 3},
+        {65535,             0xcd, 3},
+        {65536,             0xce, 5},
+        {4294967295LL,      0xce, 5},
+        {4294967296LL,      0xcf, 9},
+        {INT64_MAX,         0xcf, 9},
+        {-1,                0xff, 1},
+        {-32,               0xe0, 1},
+        {-33,               0xd0, 2},
+        {INT8_MIN,          0xd0, 2},
+        {INT8_MIN - 1,      0xd1, 3},
+        {INT16_MIN,         0xd1, 3},
+        {INT16_MIN - 1,     0xd2, 5},
+        {INT32_MIN,         0xd2, 5},
+        {INT32_MIN - 1LL,   0xd3, 9},
+        {INT64_MIN,         0xd3, 9},
+    };
+    for (int n = 0; n < MP_ARRAY_SIZE(ints); n++)
+        test_roundtrip(&NODE_INT(ints[n].v), ints[n].tag, ints[n].size);
+}
+
+static void test_str(size_t len, int tag, size_t header)
+{
+    char *s = talloc_zero_size(NULL, len + 1);
+    memset(s, 'x', len);
+    test_roundtrip(&NODE_STR(s), tag, header + len);
+    talloc_free(s);
+}
+
+static void test_msgpack_strings(void **state)
+{
+    test_str(0, 0xa0, 1);
+    test_str(31, 0xbf, 1);
+    test_str(32, 0xd9, 2);
+    test_str(255, 0xd9, 2);
+    test_str(256, 0xda, 3);
+    test_str(65535, 0xda, 3);
+    test_str(65536, 0xdb, 5);
+
+    // Strings with embedded 0 bytes can't be represented.
+    test_parse_fail("\xa3" "a\0b", 4);
+}
+
+static void test_bin(size_t len, int tag, size_t header)
+{
+    struct mpv_byte_array ba = {
+        .data = talloc_zero_size(NULL, len + 1),
+        .size = len,
+    };
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_BYTE_ARRAY,
+                                      .u.ba = &ba}, tag, header + len);
+    talloc_free(ba.data);
+}
+
+static void test_msgpack_bin(void **state)
+{
+    test_bin(0, 0xc4, 2);
+    test_bin(1, 0xc4, 2);
+    test_bin(255, 0xc4, 2);
+    test_bin(256, 0xc5, 3);
+    test_bin(65536, 0xc6, 5);
+}
+
+static void test_list(int format, int num, int tag, size_t size)
+{
+    struct mpv_node_list list = {
+        .num = num,
+        .values = talloc_zero_array(NULL, struct mpv_node, num),
+        .keys = talloc_zero_array(NULL, char *, num),
+    };
+    for (int n = 0; n < num; n++) {
+        list.values[n] = NODE_INT(n % 100);
+        list.keys[n] = talloc_asprintf(list.keys, "%c", 'A' + n % 26);
+    }
+    test_roundtrip(&(struct mpv_node){.format = format, .u.list = &list},
+                   tag, size);
+    talloc_free(list.values);
+    talloc_free(list.keys);
+}
+
+static void test_msgpack_containers(void **state)
+{
+    test_list(MPV_FORMAT_NODE_ARRAY, 0, 0x90, 1);
+    test_list(MPV_FORMAT_NODE_ARRAY, 15, 0x9f, 1 + 15);
+    test_list(MPV_FORMAT_NODE_ARRAY, 16, 0xdc, 3 + 16);
+    test_list(MPV_FORMAT_NODE_ARRAY, 65536, 0xdd, 5 + 65536);
+    test_list(MPV_FORMAT_NODE_MAP, 0, 0x80, 1);
+    test_list(MPV_FORMAT_NODE_MAP, 15, 0x8f, 1 + 15 * 3);
+    test_list(MPV_FORMAT_NODE_MAP, 16, 0xde, 3 + 16 * 3);
+
+    // Nested containers, as used by the IPC protocol.
+    struct mpv_node cmd[] = {NODE_STR("get_property"), NODE_STR("pause")};
+    struct mpv_node_list cmd_list = {.num = 2, .values = cmd};
+    struct mpv_node msg[] = {
+        {.format = MPV_FORMAT_NODE_ARRAY, .u.list = &cmd_list},
+        NODE_INT(1),
+    };
+    struct mpv_node_list msg_list = {
+        .num = 2,
+        .values = msg,
+        .keys = (char *[]){"command", "request_id"},
+    };
+    test_roundtrip(&(struct mpv_node){.format = MPV_FORMAT_NODE_MAP,
+                                      .u.list = &msg_list}, 0x82, 41);
+}
+
+static void test_msgpack_invalid(void **state)
+{
+    test_parse_fail("", 0);
+    test_parse_fail("\xc1", 1);                     // reserved
+    test_parse_fail("\xd4\x01\x00", 3);             // fixext 1
+    test_parse_fail("\xcf\x80\0\0\0\0\0\0\0", 9);   // uint64 > INT64_MAX
+    test_parse_fail("\x81\x01\x02", 3);             // non-string map key
+    test_parse_fail("\xdd\xff\xff\xff\xff", 5);     // huge array length
+    test_parse_fail("\x91\x91\x91\x91\x91\x91\x91\x91\x91\x91\x90", 11);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_msgpack_scalars),
+        cmocka_unit_test(test_msgpack_ints),
+        cmocka_unit_test(test_msgpack_strings),
+        cmocka_unit_test(test_msgpack_bin),
+        cmocka_unit_test(test_msgpack_containers),
+        cmocka_unit_test(test_msgpack_invalid),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -263,6 +263,7 @@ def build(ctx):
         ( "common/version.c" ),
 
         ## Demuxers
+        ( "demux/cache.c" ),
         ( "demux/codec_tags.c" ),
         ( "demux/cue.c" ),
         ( "demux/demux.c" ),
@@ -312,6 +313,7 @@ def build(ctx):
         ( "misc/charset_conv.c" ),
         ( "misc/dispatch.c" ),
         ( "misc/json.c" ),
+        ( "misc/msgpack.c" ),
         ( "misc/node.c" ),
         ( "misc/rendezvous.c" ),
         ( "misc/ring.c" ),
@@ -372,6 +374,7 @@ def build(ctx):
         ( "stream/stream_mf.c" ),
         ( "stream/stream_null.c" ),
         ( "stream/stream_rar.c" ),
+        ( "stream/stream_shm.c",                 "shm-stream" ),
         ( "stream/stream_smb.c",                 "libsmbclient" ),
         ( "stream/stream_tv.c",                  "tv" ),
         ( "stream/tv.c",                         "tv" ),